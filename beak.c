@@ -1,90 +1,5478 @@
+// getaddrinfo() and friends aren't part of C99
+#define _DEFAULT_SOURCE
 #include <raylib.h>
 #include <raymath.h>
+#include <rlgl.h>
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
 #include <math.h>
 #include <stddef.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/input.h>
+#endif
 
-#define NUM_COLORS 5
+// Most colors --palette accepts
+#define MAX_COLORS 64
+
+// Number of GPU->CPU copies of undo entries that can be in flight at once
+#define MAX_READBACKS 4
+
+// Number of undo entries that can be queued for compression at once
+#define MAX_COMPRESS_JOBS 16
+#define MAX_EXPORT_JOBS 4
+
+// Most threads a fill uses besides the calling one
+#define MAX_FILL_THREADS 16
+
+// Most layers --layers accepts, hidden layers are a bitmask
+#define MAX_LAYERS 8
+
+// Number of tablet samples queued between frames, later samples are merged
+// into the last one
+#define MAX_TABLET_SAMPLES 32
+
+// Samples closer than this in canvas pixels are merged
+#define STROKE_MIN_SPACING 0.25f
+
+// Oldest back buffer that is brought up to date by copying only what
+// changed since, older ones are copied in full
+#define MAX_BUFFER_AGE 4
+
+// Most segments a smoothed stroke is split into between two samples
+#define STROKE_MAX_SUBDIVISIONS 32
 
 #define ARRLEN(arr) \
     (sizeof(arr) / sizeof((arr)[0]))
 
-#define MAX(a, b) \
-    ((a > b) ? a : b)
+#define MAX(a, b) \
+    ((a > b) ? a : b)
+
+#define MIN(a, b) \
+    ((a < b) ? a : b)
+
+#define CLAMP(lower, x, upper) \
+    (MIN(upper, MAX(lower, x)))
+
+//
+// Bounds: Integer rectangle in canvas coordinates, x0/y0 inclusive and x1/y1
+//         exclusive. Canvas coordinates match the row order of the framebuffer
+//         texture, the y-axis is not inverted.
+//
+typedef struct Bounds {
+    int x0, y0;
+    int x1, y1;
+} Bounds;
+
+#define BOUNDS_EMPTY \
+    ((Bounds){INT_MAX, INT_MAX, INT_MIN, INT_MIN})
+
+static inline bool bounds_is_empty(Bounds b) {
+    return b.x0 >= b.x1 || b.y0 >= b.y1;
+}
+
+static inline bool bounds_equal(Bounds a, Bounds b) {
+    return a.x0 == b.x0 && a.y0 == b.y0 && a.x1 == b.x1 && a.y1 == b.y1;
+}
+
+static inline Bounds bounds_union(Bounds a, Bounds b) {
+    if (bounds_is_empty(a))
+        return b;
+    if (bounds_is_empty(b))
+        return a;
+    return (Bounds){MIN(a.x0, b.x0), MIN(a.y0, b.y0), MAX(a.x1, b.x1), MAX(a.y1, b.y1)};
+}
+
+static inline Bounds bounds_intersect(Bounds a, Bounds b) {
+    return (Bounds){MAX(a.x0, b.x0), MAX(a.y0, b.y0), MIN(a.x1, b.x1), MIN(a.y1, b.y1)};
+}
+
+// Bounds covering a capsule from start to end with the given radius, padded
+// by a pixel to account for rasterization of the edges.
+static inline Bounds bounds_from_capsule(Vector2 start, Vector2 end, float radius) {
+    return (Bounds){
+        (int)floorf(MIN(start.x, end.x) - radius) - 1,
+        (int)floorf(MIN(start.y, end.y) - radius) - 1,
+        (int)ceilf(MAX(start.x, end.x) + radius) + 1,
+        (int)ceilf(MAX(start.y, end.y) + radius) + 1,
+    };
+}
+
+static inline bool color_equal(Color a, Color b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+// Size of a canvas tile in pixels
+#define TILE_SIZE 256
+
+//
+// Canvas: The painting, split into TILE_SIZE x TILE_SIZE render textures.
+//         Tiles are only allocated once painted, until then they are
+//         implicitly the background color, so canvas size doesn't cost
+//         memory until it is used. Since the y-axis is inverted when
+//         drawing to a tile, texel rows match canvas rows.
+//
+// width, height: Size of the canvas in pixels.
+// tiles_x, tiles_y: Number of tiles along each axis.
+// tiles: tiles_x*tiles_y tiles in row-major order, id 0 if unallocated.
+// blank: A tile cleared to `background`, read in place of unallocated tiles.
+// background: Color of unallocated tiles.
+// stale_mipmaps: Per tile, whether it was written since its mipmaps were
+//                last generated. Mipmaps are only generated for tiles drawn
+//                zoomed out.
+// changed: Per tile, whether it was written since it was last composited
+//          with the other layers.
+//
+typedef struct Canvas {
+    int width, height;
+    int tiles_x, tiles_y;
+    RenderTexture2D *tiles;
+    RenderTexture2D blank;
+    Color background;
+    bool *stale_mipmaps;
+    bool *changed;
+} Canvas;
+
+static inline Bounds tile_bounds(int tx, int ty) {
+    return (Bounds){tx*TILE_SIZE, ty*TILE_SIZE, (tx + 1)*TILE_SIZE, (ty + 1)*TILE_SIZE};
+}
+
+static inline Bounds canvas_bounds(const Canvas *canvas) {
+    return (Bounds){0, 0, canvas->width, canvas->height};
+}
+
+static inline size_t canvas_tile_count(const Canvas *canvas) {
+    return (size_t)canvas->tiles_x*canvas->tiles_y;
+}
+
+// Allocates an uninitialized RGBA image
+static inline Image alloc_image(int width, int height) {
+    return (Image){
+        .data = RL_MALLOC((size_t)width*height*sizeof(Color)),
+        .width = width,
+        .height = height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+}
+
+// Checks whether all pixels of a width x height region, with rows `stride`
+// pixels apart, are the given color
+static bool pixels_are_color(const Color *pixels, int stride, int width, int height, Color color) {
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+            if (!color_equal(pixels[y*stride + x], color))
+                return false;
+    return true;
+}
+
+#ifndef BEAK_NO_MAIN
+// GLX_EXT_buffer_age, declared here since GL/glx.h pulls in Xlib whose
+// names clash with raylib's
+#define GLX_BACK_BUFFER_AGE_EXT 0x20F4
+void *glXGetCurrentDisplay(void);
+unsigned long glXGetCurrentDrawable(void);
+const char *glXQueryExtensionsString(void *display, int screen);
+void glXQueryDrawable(void *display, unsigned long drawable, int attribute, unsigned int *value);
+
+// Whether the window's back buffer reports how many frames old its contents
+// are. Only GLX does here, there's no current GLX display under EGL.
+static bool buffer_age_supported(void) {
+    void *display = glXGetCurrentDisplay();
+    if (display == NULL)
+        return false;
+    const char *extensions = glXQueryExtensionsString(display, 0);
+    return extensions != NULL && strstr(extensions, "GLX_EXT_buffer_age") != NULL;
+}
+
+// How many frames ago the back buffer was presented, 0 if its contents are
+// undefined
+static unsigned buffer_age(void) {
+    unsigned age = 0;
+    glXQueryDrawable(glXGetCurrentDisplay(), glXGetCurrentDrawable(), GLX_BACK_BUFFER_AGE_EXT, &age);
+    return age;
+}
+#endif
+
+// GPU->GPU copy of a width x height region between framebuffers. Positions
+// are in texels, so no flipping is needed.
+static void blit_framebuffer(RenderTexture2D src, int src_x, int src_y,
+                             RenderTexture2D dst, int dst_x, int dst_y,
+                             int width, int height) {
+    // Make sure any batched draws to src/dst land before the copy
+    rlDrawRenderBatchActive();
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, src.id);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dst.id);
+    glBlitFramebuffer(src_x, src_y, src_x + width, src_y + height,
+                      dst_x, dst_y, dst_x + width, dst_y + height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    rlDisableFramebuffer();
+}
+
+static RenderTexture2D load_tile(Color color) {
+    RenderTexture2D tile = LoadRenderTexture(TILE_SIZE, TILE_SIZE);
+    BeginTextureMode(tile);
+    ClearBackground(color);
+    EndTextureMode();
+    return tile;
+}
+
+// Unloads an array of tiles, unallocated tiles are skipped
+static void unload_tiles(RenderTexture2D *tiles, size_t count) {
+    if (tiles == NULL)
+        return;
+    for (size_t i = 0; i < count; ++i)
+        if (tiles[i].id != 0)
+            UnloadRenderTexture(tiles[i]);
+    free(tiles);
+}
+
+static void canvas_init(Canvas *canvas, int width, int height, Color background) {
+    canvas->width = width;
+    canvas->height = height;
+    canvas->tiles_x = (width + TILE_SIZE - 1)/TILE_SIZE;
+    canvas->tiles_y = (height + TILE_SIZE - 1)/TILE_SIZE;
+    canvas->tiles = calloc(canvas_tile_count(canvas), sizeof(RenderTexture2D));
+    canvas->stale_mipmaps = calloc(canvas_tile_count(canvas), sizeof(bool));
+    canvas->changed = calloc(canvas_tile_count(canvas), sizeof(bool));
+    canvas->blank = load_tile(background);
+    canvas->background = background;
+}
+
+static void canvas_unload(Canvas *canvas) {
+    unload_tiles(canvas->tiles, canvas_tile_count(canvas));
+    canvas->tiles = NULL;
+    free(canvas->stale_mipmaps);
+    canvas->stale_mipmaps = NULL;
+    free(canvas->changed);
+    canvas->changed = NULL;
+    UnloadRenderTexture(canvas->blank);
+}
+
+// The tile at tx, ty for reading, the blank tile if it isn't allocated
+static inline RenderTexture2D canvas_read_tile(const Canvas *canvas, int tx, int ty) {
+    const RenderTexture2D tile = canvas->tiles[ty*canvas->tiles_x + tx];
+    return (tile.id != 0) ? tile : canvas->blank;
+}
+
+// The tile at tx, ty for writing, allocating it if needed
+static inline RenderTexture2D canvas_write_tile(Canvas *canvas, int tx, int ty) {
+    RenderTexture2D *tile = &canvas->tiles[ty*canvas->tiles_x + tx];
+    if (tile->id == 0)
+        *tile = load_tile(canvas->background);
+    canvas->stale_mipmaps[ty*canvas->tiles_x + tx] = true;
+    canvas->changed[ty*canvas->tiles_x + tx] = true;
+    return *tile;
+}
+
+static inline bool canvas_has_tile(const Canvas *canvas, int tx, int ty) {
+    return canvas->tiles[ty*canvas->tiles_x + tx].id != 0;
+}
+
+// Emits a triangle into the current batch, raylib culls clockwise triangles
+// so the winding is fixed up to be counter-clockwise on screen.
+static inline void emit_triangle(Vector2 a, Vector2 b, Vector2 c) {
+    if ((b.x - a.x)*(c.y - a.y) - (b.y - a.y)*(c.x - a.x) > 0.0f) {
+        Vector2 tmp = b;
+        b = c;
+        c = tmp;
+    }
+    rlVertex2f(a.x, a.y);
+    rlVertex2f(b.x, b.y);
+    rlVertex2f(c.x, c.y);
+}
+
+// Number of triangles for a disc of the given radius, chosen so the edges
+// stray at most a quarter of a pixel from the real circle
+static inline int disc_segments(float radius) {
+    if (radius <= 0.25f)
+        return 8;
+    return CLAMP(8, (int)ceilf(PI/acosf(1.0f - 0.25f/radius)), 128);
+}
+
+// Emits the triangles of a capsule from a to b into the current batch
+static void emit_capsule(Vector2 a, Vector2 b, float radius, int segments) {
+    rlCheckRenderBatchLimit(3*(segments + 2));
+
+    // Disc at the end, the disc at the start was emitted with the previous
+    // segment (or by the caller for the first point)
+    const float step = 2.0f*PI/segments;
+    for (int i = 0; i < segments; ++i) {
+        const Vector2 p0 = {b.x + radius*cosf(i*step), b.y + radius*sinf(i*step)};
+        const Vector2 p1 = {b.x + radius*cosf((i + 1)*step), b.y + radius*sinf((i + 1)*step)};
+        emit_triangle(b, p0, p1);
+    }
+
+    // Quad along the segment
+    const Vector2 d = Vector2Subtract(b, a);
+    const float length = Vector2Length(d);
+    if (length <= 0.0f)
+        return;
+    const Vector2 n = {-d.y*radius/length, d.x*radius/length};
+    emit_triangle(Vector2Add(a, n), Vector2Subtract(a, n), Vector2Subtract(b, n));
+    emit_triangle(Vector2Add(a, n), Vector2Subtract(b, n), Vector2Add(b, n));
+}
+
+//
+// BrushInstance: Per-segment data for the brush shader, one instance is
+//                expanded to a single quad around the capsule.
+//
+typedef struct BrushInstance {
+    Vector2 start;
+    Vector2 end;
+    float radius;
+    Color color;
+} BrushInstance;
+
+//
+// Brush: Draws strokes with one instanced quad per segment. The capsule
+//        shape is computed analytically in the fragment shader as a signed
+//        distance, so a segment costs 4 vertices regardless of radius and
+//        gets anti-aliased edges without seams. Needs OpenGL 3.3, otherwise
+//        strokes are drawn as raylib triangles.
+//
+// shader: The capsule shader, id 0 if unavailable.
+// origin_loc, tile_size_loc: Uniform locations, positions are passed in
+//                            canvas coordinates and moved to the tile
+//                            being drawn in the vertex shader.
+// vao, vbo: Vertex array and instance buffer.
+// instances: CPU staging of the instances for the current frame.
+// capacity: Number of instances `instances` has room for.
+//
+typedef struct Brush {
+    Shader shader;
+    int origin_loc;
+    int tile_size_loc;
+    GLuint vao;
+    GLuint vbo;
+    BrushInstance *instances;
+    size_t capacity;
+} Brush;
+
+//
+// Fills `instances` with one capsule per segment of a polyline through
+// `count` points, a single point becomes a disc. Returns the number of
+// instances, which is at most `count`.
+//
+static size_t fill_instances(BrushInstance *instances, const Vector2 *points, size_t count, float radius, Color color) {
+    const size_t instance_count = MAX(count - 1, 1);
+    for (size_t i = 0; i < instance_count; ++i) {
+        instances[i] = (BrushInstance){
+            .start = points[i],
+            .end = points[MIN(i + 1, count - 1)],
+            .radius = radius,
+            .color = color,
+        };
+    }
+    return instance_count;
+}
+
+static const char *brush_vs =
+    "#version 330\n"
+    "layout(location = 0) in vec4 segment;\n"
+    "layout(location = 1) in float radius;\n"
+    "layout(location = 2) in vec4 color;\n"
+    "uniform vec2 origin;\n"
+    "uniform float tile_size;\n"
+    "out vec2 position;\n"
+    "flat out vec4 capsule;\n"
+    "flat out float capsule_radius;\n"
+    "flat out vec4 capsule_color;\n"
+    "void main() {\n"
+    "    vec2 d = segment.zw - segment.xy;\n"
+    "    float len = length(d);\n"
+    "    vec2 dir = (len > 0.0) ? d/len : vec2(1.0, 0.0);\n"
+    "    vec2 n = vec2(-dir.y, dir.x);\n"
+    // Pad by a pixel to make room for the anti-aliased edge
+    "    float e = radius + 1.0;\n"
+    "    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1)*2.0 - 1.0;\n"
+    "    position = ((corner.x < 0.0) ? segment.xy - dir*e : segment.zw + dir*e) + n*e*corner.y;\n"
+    "    capsule = segment;\n"
+    "    capsule_radius = radius;\n"
+    "    capsule_color = color;\n"
+    // Texel rows match canvas rows, so no y inversion here
+    "    gl_Position = vec4((position - origin)/tile_size*2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *brush_fs =
+    "#version 330\n"
+    "in vec2 position;\n"
+    "flat in vec4 capsule;\n"
+    "flat in float capsule_radius;\n"
+    "flat in vec4 capsule_color;\n"
+    "out vec4 frag_color;\n"
+    "void main() {\n"
+    "    vec2 pa = position - capsule.xy;\n"
+    "    vec2 ba = capsule.zw - capsule.xy;\n"
+    "    float h = clamp(dot(pa, ba)/max(dot(ba, ba), 1e-6), 0.0, 1.0);\n"
+    "    float dist = length(pa - ba*h) - capsule_radius;\n"
+    "    frag_color = vec4(capsule_color.rgb, capsule_color.a*clamp(0.5 - dist, 0.0, 1.0));\n"
+    "}\n";
+
+static void brush_load(Brush *brush) {
+    *brush = (Brush){0};
+    if (rlGetVersion() != RL_OPENGL_33 && rlGetVersion() != RL_OPENGL_43)
+        return;
+
+    // raylib hands back its default shader if compilation fails
+    Shader shader = LoadShaderFromMemory(brush_vs, brush_fs);
+    if (shader.id == 0 || shader.id == rlGetShaderIdDefault()) {
+        fprintf(stderr, "[warning]: Failed to compile brush shader, falling back to triangles\n");
+        return;
+    }
+    brush->shader = shader;
+    brush->origin_loc = GetShaderLocation(shader, "origin");
+    brush->tile_size_loc = GetShaderLocation(shader, "tile_size");
+
+    glGenVertexArrays(1, &brush->vao);
+    glGenBuffers(1, &brush->vbo);
+    glBindVertexArray(brush->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, brush->vbo);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(BrushInstance), (void *)offsetof(BrushInstance, start));
+    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(BrushInstance), (void *)offsetof(BrushInstance, radius));
+    glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(BrushInstance), (void *)offsetof(BrushInstance, color));
+    for (GLuint i = 0; i < 3; ++i) {
+        glEnableVertexAttribArray(i);
+        glVertexAttribDivisor(i, 1);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static void brush_unload(Brush *brush) {
+    if (brush->shader.id == 0)
+        return;
+    glDeleteBuffers(1, &brush->vbo);
+    glDeleteVertexArrays(1, &brush->vao);
+    UnloadShader(brush->shader);
+    free(brush->instances);
+    *brush = (Brush){0};
+}
+
+// Uploads one instance per segment of a polyline through `count` points,
+// a single point becomes a disc. Returns the number of instances.
+static size_t brush_upload(Brush *brush, const Vector2 *points, size_t count, float radius, Color color) {
+    const size_t instance_count = MAX(count - 1, 1);
+    if (brush->capacity < instance_count) {
+        brush->capacity = MAX(64, 2*instance_count);
+        brush->instances = realloc(brush->instances, brush->capacity*sizeof(BrushInstance));
+    }
+
+    fill_instances(brush->instances, points, count, radius, color);
+
+    glBindBuffer(GL_ARRAY_BUFFER, brush->vbo);
+    glBufferData(GL_ARRAY_BUFFER, instance_count*sizeof(BrushInstance), brush->instances, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return instance_count;
+}
+
+// Draws the uploaded instances to the tile at origin, must be called inside
+// BeginTextureMode() for the tile. Erasing scales down what's in the tile
+// by the brush's coverage instead.
+static void brush_draw(const Brush *brush, Vector2 origin, size_t instance_count, bool erase) {
+    // Blend alpha separately so anti-aliased edges don't eat into the alpha
+    // of the tile, and the quads' winding doesn't matter.
+    if (erase)
+        glBlendFunc(GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+    else
+        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glDisable(GL_CULL_FACE);
+
+    glUseProgram(brush->shader.id);
+    glUniform2f(brush->origin_loc, origin.x, origin.y);
+    glUniform1f(brush->tile_size_loc, TILE_SIZE);
+    glBindVertexArray(brush->vao);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, instance_count);
+    glBindVertexArray(0);
+    glUseProgram(0);
+
+    // Back to raylib's defaults
+    glEnable(GL_CULL_FACE);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+// Draws a polyline of capsules through `count` points to all tiles it
+// overlaps, positions are in canvas coordinates. Each tile gets all its
+// segments as a single batch, using the brush shader if available. A fully
+// transparent color erases to transparency, which is how layers above the
+// bottom one are erased. Returns the region that was drawn to.
+static Bounds canvas_draw_stroke(Canvas *canvas, Brush *brush, const Vector2 *points, size_t count, float radius, Color color) {
+    Bounds bounds = BOUNDS_EMPTY;
+    for (size_t i = 0; i < count; ++i)
+        bounds = bounds_union(bounds, bounds_from_capsule(points[i], points[i], radius));
+    bounds = bounds_intersect(bounds, canvas_bounds(canvas));
+    if (bounds_is_empty(bounds))
+        return BOUNDS_EMPTY;
+
+    const bool erase = color.a == 0;
+    if (erase)
+        color = BLACK;
+
+    // With the shader the same instances are drawn to every tile, letting
+    // the GPU clip what falls outside.
+    const bool use_shader = brush->shader.id != 0;
+    const size_t instance_count = (use_shader) ? brush_upload(brush, points, count, radius, color) : 0;
+
+    const int segments = disc_segments(radius);
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            const RenderTexture2D tile = canvas_write_tile(canvas, tx, ty);
+            const Vector2 origin = {tx*TILE_SIZE, ty*TILE_SIZE};
+            BeginTextureMode(tile);
+            if (use_shader) {
+                brush_draw(brush, origin, instance_count, erase);
+                EndTextureMode();
+                continue;
+            }
+
+            // Move to tile coordinates and invert y-coord as texture/raylib
+            // y-coords are inverted.
+            const Bounds tile_part = bounds_intersect(bounds, tile_bounds(tx, ty));
+            Vector2 prev = Vector2Subtract(points[0], origin);
+            prev.y = TILE_SIZE - prev.y;
+            if (erase)
+                glBlendFunc(GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+            rlBegin(RL_TRIANGLES);
+            rlColor4ub(color.r, color.g, color.b, color.a);
+            emit_capsule(prev, prev, radius, segments);
+            for (size_t i = 1; i < count; ++i) {
+                Vector2 p = Vector2Subtract(points[i], origin);
+                p.y = TILE_SIZE - p.y;
+                // Skip segments that don't touch this tile
+                const Bounds segment = bounds_from_capsule(points[i - 1], points[i], radius);
+                if (!bounds_is_empty(bounds_intersect(segment, tile_part)))
+                    emit_capsule(prev, p, radius, segments);
+                prev = p;
+            }
+            rlEnd();
+            if (erase) {
+                rlDrawRenderBatchActive();
+                glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            }
+            EndTextureMode();
+        }
+    }
+    return bounds;
+}
+
+#ifndef BEAK_NO_MAIN
+// Draws the tiles of the canvas overlapping `region` of the window, in
+// screen pixels, with the canvas point `view_x, view_y` in the top left
+// corner scaled by `zoom`. Zoomed out tiles are sampled from their mipmaps,
+// which are regenerated first if stale.
+static void canvas_draw(Canvas *canvas, float view_x, float view_y, float zoom, Bounds region) {
+    const Bounds view = bounds_intersect((Bounds){floorf(view_x + region.x0/zoom), floorf(view_y + region.y0/zoom),
+                                                  ceilf(view_x + region.x1/zoom), ceilf(view_y + region.y1/zoom)},
+                                         canvas_bounds(canvas));
+    if (bounds_is_empty(view))
+        return;
+
+    for (int ty = view.y0/TILE_SIZE; ty <= (view.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = view.x0/TILE_SIZE; tx <= (view.x1 - 1)/TILE_SIZE; ++tx) {
+            if (!canvas_has_tile(canvas, tx, ty))
+                continue;
+            Texture2D *texture = &canvas->tiles[ty*canvas->tiles_x + tx].texture;
+            if (zoom < 1.0f) {
+                bool *stale = &canvas->stale_mipmaps[ty*canvas->tiles_x + tx];
+                if (*stale || texture->mipmaps == 1)
+                    GenTextureMipmaps(texture);
+                *stale = false;
+                SetTextureFilter(*texture, TEXTURE_FILTER_TRILINEAR);
+            } else {
+                // Keep pixels crisp at and above 1:1
+                SetTextureFilter(*texture, TEXTURE_FILTER_POINT);
+            }
+
+            // Edge tiles may stick out past the canvas
+            const Bounds tile = bounds_intersect(tile_bounds(tx, ty), canvas_bounds(canvas));
+            DrawTexturePro(*texture,
+                           (Rectangle){0, 0, tile.x1 - tile.x0, tile.y1 - tile.y0},
+                           (Rectangle){(tile.x0 - view_x)*zoom, (tile.y0 - view_y)*zoom,
+                                       (tile.x1 - tile.x0)*zoom, (tile.y1 - tile.y0)*zoom},
+                           (Vector2){0, 0}, 0.0f, WHITE);
+        }
+    }
+}
+
+//
+// Layers: Canvases drawn over each other, bottom first. The bottom layer is
+//         opaque like a lone canvas, the ones above start out transparent
+//         and hold premultiplied colors, which is what the brush's blend
+//         function leaves in them. With more than one layer the window shows
+//         a cached composite whose tiles are only redone when a layer's tile
+//         changed, so a frame costs the same at any number of layers.
+//
+// canvases, count: The layers.
+// active: Layer that strokes, clears and undo work on.
+// hidden: Bit per hidden layer.
+// composite: The visible layers flattened, unused with a single layer.
+//
+typedef struct Layers {
+    Canvas canvases[MAX_LAYERS];
+    int count;
+    int active;
+    uint32_t hidden;
+    Canvas composite;
+} Layers;
+
+static void layers_init(Layers *layers, int count, int width, int height, Color background) {
+    *layers = (Layers){.count = count};
+    for (int i = 0; i < count; ++i)
+        canvas_init(&layers->canvases[i], width, height, (i == 0) ? background : BLANK);
+    if (count > 1)
+        canvas_init(&layers->composite, width, height, background);
+}
+
+static void layers_unload(Layers *layers) {
+    for (int i = 0; i < layers->count; ++i)
+        canvas_unload(&layers->canvases[i]);
+    if (layers->count > 1)
+        canvas_unload(&layers->composite);
+}
+
+static inline bool layers_visible(const Layers *layers, int layer) {
+    return !(layers->hidden & (1u << layer));
+}
+
+// Shows or hides a layer, which changes every tile of the composite it has
+static void layers_toggle(Layers *layers, int layer) {
+    layers->hidden ^= 1u << layer;
+    Canvas *canvas = &layers->canvases[layer];
+    for (size_t i = 0; i < canvas_tile_count(canvas); ++i)
+        canvas->changed[i] |= canvas->tiles[i].id != 0;
+}
+
+// Brings the tiles of the composite overlapping `bounds` up to date. Tiles
+// outside it stay marked changed until they're needed.
+static void layers_composite(Layers *layers, Bounds bounds) {
+    Canvas *composite = &layers->composite;
+    if (layers->count == 1)
+        return;
+    bounds = bounds_intersect(bounds, canvas_bounds(composite));
+    if (bounds_is_empty(bounds))
+        return;
+
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            const size_t i = ty*composite->tiles_x + tx;
+            bool changed = false, painted = false;
+            for (int layer = 0; layer < layers->count; ++layer) {
+                Canvas *canvas = &layers->canvases[layer];
+                changed |= canvas->changed[i];
+                canvas->changed[i] = false;
+                painted |= layers_visible(layers, layer) && canvas_has_tile(canvas, tx, ty);
+            }
+            if (!changed)
+                continue;
+
+            // Nothing visible left here, the background shows through
+            if (!painted) {
+                if (composite->tiles[i].id != 0)
+                    UnloadRenderTexture(composite->tiles[i]);
+                composite->tiles[i] = (RenderTexture2D){0};
+                continue;
+            }
+
+            // The bottom layer is opaque so it's copied as is, the rest is
+            // blended over it premultiplied
+            const RenderTexture2D tile = canvas_write_tile(composite, tx, ty);
+            const RenderTexture2D bottom = layers_visible(layers, 0) ? canvas_read_tile(&layers->canvases[0], tx, ty)
+                                                                     : composite->blank;
+            blit_framebuffer(bottom, 0, 0, tile, 0, 0, TILE_SIZE, TILE_SIZE);
+            BeginTextureMode(tile);
+            glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+            for (int layer = 1; layer < layers->count; ++layer) {
+                const Canvas *canvas = &layers->canvases[layer];
+                if (!layers_visible(layers, layer) || !canvas_has_tile(canvas, tx, ty))
+                    continue;
+                // Flipped so texel rows stay in canvas order
+                DrawTextureRec(canvas->tiles[i].texture, (Rectangle){0, 0, TILE_SIZE, -TILE_SIZE},
+                               (Vector2){0, 0}, WHITE);
+            }
+            rlDrawRenderBatchActive();
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            EndTextureMode();
+        }
+    }
+}
+
+// The canvas to show, after compositing what's visible of it
+static Canvas *layers_flatten(Layers *layers, Bounds bounds) {
+    if (layers->count == 1)
+        return &layers->canvases[0];
+    layers_composite(layers, bounds);
+    return &layers->composite;
+}
+
+#endif // BEAK_NO_MAIN
+
+// GPU->CPU copy of the region `bounds` of canvas into pixels, or to offset
+// `pixels` of the bound pixel pack buffer
+static void canvas_read_pixels(const Canvas *canvas, Bounds bounds, void *pixels) {
+    const int width = bounds.x1 - bounds.x0;
+    glPixelStorei(GL_PACK_ROW_LENGTH, width);
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            const Bounds part = bounds_intersect(bounds, tile_bounds(tx, ty));
+            const size_t offset = ((size_t)(part.y0 - bounds.y0)*width + (part.x0 - bounds.x0))*sizeof(Color);
+            rlEnableFramebuffer(canvas_read_tile(canvas, tx, ty).id);
+            glReadPixels(part.x0 - tx*TILE_SIZE, part.y0 - ty*TILE_SIZE,
+                         part.x1 - part.x0, part.y1 - part.y0,
+                         GL_RGBA, GL_UNSIGNED_BYTE, (void *)((uintptr_t)pixels + offset));
+        }
+    }
+    rlDisableFramebuffer();
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+}
+
+// CPU->GPU copy of pixels to the region `bounds` of canvas
+static void canvas_write_pixels(Canvas *canvas, Bounds bounds, const Color *pixels) {
+    const int width = bounds.x1 - bounds.x0;
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            const Bounds part = bounds_intersect(bounds, tile_bounds(tx, ty));
+            const Color *src = &pixels[(part.y0 - bounds.y0)*width + (part.x0 - bounds.x0)];
+            // Writing the background to an unallocated tile changes nothing
+            if (!canvas_has_tile(canvas, tx, ty) &&
+                pixels_are_color(src, width, part.x1 - part.x0, part.y1 - part.y0, canvas->background))
+                continue;
+            UpdateTextureRec(canvas_write_tile(canvas, tx, ty).texture,
+                             (Rectangle){part.x0 - tx*TILE_SIZE, part.y0 - ty*TILE_SIZE,
+                                         part.x1 - part.x0, part.y1 - part.y0},
+                             src);
+        }
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+// GPU->GPU copy of the region `bounds` of canvas to position 0, 0 of dst
+static void canvas_blit_to(const Canvas *canvas, Bounds bounds, RenderTexture2D dst) {
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            const Bounds part = bounds_intersect(bounds, tile_bounds(tx, ty));
+            blit_framebuffer(canvas_read_tile(canvas, tx, ty), part.x0 - tx*TILE_SIZE, part.y0 - ty*TILE_SIZE,
+                             dst, part.x0 - bounds.x0, part.y0 - bounds.y0,
+                             part.x1 - part.x0, part.y1 - part.y0);
+        }
+    }
+}
+
+// GPU->GPU copy from position 0, 0 of src to the region `bounds` of canvas
+static void canvas_blit_from(RenderTexture2D src, Canvas *canvas, Bounds bounds) {
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            const Bounds part = bounds_intersect(bounds, tile_bounds(tx, ty));
+            blit_framebuffer(src, part.x0 - bounds.x0, part.y0 - bounds.y0,
+                             canvas_write_tile(canvas, tx, ty), part.x0 - tx*TILE_SIZE, part.y0 - ty*TILE_SIZE,
+                             part.x1 - part.x0, part.y1 - part.y0);
+        }
+    }
+}
+
+// GPU->GPU copy of the region `bounds` between two canvases of the same size
+static void canvas_blit(const Canvas *src, Canvas *dst, Bounds bounds) {
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            // Both are the background, nothing to copy
+            if (!canvas_has_tile(src, tx, ty) && !canvas_has_tile(dst, tx, ty))
+                continue;
+            const Bounds part = bounds_intersect(bounds, tile_bounds(tx, ty));
+            blit_framebuffer(canvas_read_tile(src, tx, ty), part.x0 - tx*TILE_SIZE, part.y0 - ty*TILE_SIZE,
+                             canvas_write_tile(dst, tx, ty), part.x0 - tx*TILE_SIZE, part.y0 - ty*TILE_SIZE,
+                             part.x1 - part.x0, part.y1 - part.y0);
+        }
+    }
+}
+
+#ifdef BEAK_NO_MAIN
+// Makes a GPU->CPU copy of the whole canvas. Saving reads back in bands, so
+// only the tools built on top of beak.c use this.
+static Image canvas_load_image(const Canvas *canvas) {
+    Image image = alloc_image(canvas->width, canvas->height);
+    canvas_read_pixels(canvas, canvas_bounds(canvas), image.data);
+    return image;
+}
+#else
+// Clears the region `bounds` of canvas to the background, on the GPU with a
+// scissored clear of each tile
+static void canvas_clear_bounds(Canvas *canvas, Bounds bounds) {
+    rlDrawRenderBatchActive();
+    glEnable(GL_SCISSOR_TEST);
+    glClearColor(canvas->background.r/255.0f, canvas->background.g/255.0f,
+                 canvas->background.b/255.0f, canvas->background.a/255.0f);
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            // Unallocated tiles already are the background
+            if (!canvas_has_tile(canvas, tx, ty))
+                continue;
+            const Bounds part = bounds_intersect(bounds, tile_bounds(tx, ty));
+            rlEnableFramebuffer(canvas_write_tile(canvas, tx, ty).id);
+            glScissor(part.x0 - tx*TILE_SIZE, part.y0 - ty*TILE_SIZE, part.x1 - part.x0, part.y1 - part.y0);
+            glClear(GL_COLOR_BUFFER_BIT);
+        }
+    }
+    glDisable(GL_SCISSOR_TEST);
+    rlDisableFramebuffer();
+}
+
+//
+// Selection: A rectangle of the active layer that can be moved, duplicated,
+//            copied and pasted. Pixels only ever move between render
+//            textures: a move lifts the selected pixels into `floating`,
+//            which follows the cursor and is blitted back on release, so
+//            moving a large region costs a few blits and no readback.
+//
+// bounds: The selection in canvas coordinates, empty if nothing is selected.
+// drag: What dragging with shift+mouse 1 is doing.
+// anchor: Canvas point the drag started at.
+// floating: Lifted pixels of `bounds` while moving.
+// offset: How far the floating pixels have been moved, they are kept inside
+//         the canvas.
+// clipboard: Pixels copied with ctrl+c/ctrl+x, id 0 if none.
+//
+typedef enum SelectionDrag {
+    SELECTION_NONE,
+    SELECTION_SELECT,
+    SELECTION_MOVE,
+} SelectionDrag;
+
+typedef struct Selection {
+    Bounds bounds;
+    SelectionDrag drag;
+    Vector2 anchor;
+    RenderTexture2D floating;
+    int offset_x, offset_y;
+    RenderTexture2D clipboard;
+} Selection;
+
+static inline bool selection_contains(const Selection *selection, Vector2 point) {
+    return point.x >= selection->bounds.x0 && point.x < selection->bounds.x1 &&
+           point.y >= selection->bounds.y0 && point.y < selection->bounds.y1;
+}
+
+// The region the selection covers once moved by `offset`
+static inline Bounds selection_target(const Selection *selection) {
+    const Bounds b = selection->bounds;
+    return (Bounds){b.x0 + selection->offset_x, b.y0 + selection->offset_y,
+                    b.x1 + selection->offset_x, b.y1 + selection->offset_y};
+}
+
+// Starts dragging out a new selection at `point`
+static void selection_begin(Selection *selection, Vector2 point) {
+    selection->drag = SELECTION_SELECT;
+    selection->anchor = point;
+    selection->bounds = BOUNDS_EMPTY;
+}
+
+// Lifts the selected pixels off the canvas to move them. Unless `copy` is
+// set the selection is cleared to the background, returns the area of the
+// canvas that changed.
+static Bounds selection_lift(Selection *selection, Canvas *canvas, Vector2 point, bool copy) {
+    const Bounds b = selection->bounds;
+    selection->drag = SELECTION_MOVE;
+    selection->anchor = point;
+    selection->offset_x = selection->offset_y = 0;
+    selection->floating = LoadRenderTexture(b.x1 - b.x0, b.y1 - b.y0);
+    canvas_blit_to(canvas, b, selection->floating);
+    if (copy)
+        return BOUNDS_EMPTY;
+    canvas_clear_bounds(canvas, b);
+    return b;
+}
+
+// Follows the cursor during a drag
+static void selection_update(Selection *selection, const Canvas *canvas, Vector2 point) {
+    if (selection->drag == SELECTION_SELECT) {
+        selection->bounds = bounds_intersect((Bounds){floorf(MIN(point.x, selection->anchor.x)),
+                                                      floorf(MIN(point.y, selection->anchor.y)),
+                                                      ceilf(MAX(point.x, selection->anchor.x)),
+                                                      ceilf(MAX(point.y, selection->anchor.y))},
+                                             canvas_bounds(canvas));
+    } else if (selection->drag == SELECTION_MOVE) {
+        const Bounds b = selection->bounds;
+        selection->offset_x = CLAMP(-b.x0, (int)roundf(point.x - selection->anchor.x), canvas->width - b.x1);
+        selection->offset_y = CLAMP(-b.y0, (int)roundf(point.y - selection->anchor.y), canvas->height - b.y1);
+    }
+}
+
+// Ends the drag, blitting moved pixels back to the canvas. Returns the area
+// of the canvas that changed.
+static Bounds selection_end(Selection *selection, Canvas *canvas) {
+    const SelectionDrag drag = selection->drag;
+    selection->drag = SELECTION_NONE;
+    // A click without dragging selects nothing
+    const Bounds b = selection->bounds;
+    if (drag == SELECTION_SELECT && (bounds_is_empty(b) || (b.x1 - b.x0)*(b.y1 - b.y0) <= 1))
+        selection->bounds = BOUNDS_EMPTY;
+    if (drag != SELECTION_MOVE)
+        return BOUNDS_EMPTY;
+    const Bounds target = selection_target(selection);
+    canvas_blit_from(selection->floating, canvas, target);
+    UnloadRenderTexture(selection->floating);
+    selection->floating = (RenderTexture2D){0};
+    selection->bounds = target;
+    selection->offset_x = selection->offset_y = 0;
+    return target;
+}
+
+// Copies the selected pixels to the clipboard
+static void selection_copy(Selection *selection, const Canvas *canvas) {
+    const Bounds b = selection->bounds;
+    if (selection->clipboard.id != 0)
+        UnloadRenderTexture(selection->clipboard);
+    selection->clipboard = LoadRenderTexture(b.x1 - b.x0, b.y1 - b.y0);
+    canvas_blit_to(canvas, b, selection->clipboard);
+}
+
+// Pastes the clipboard with its top left corner at `point`, kept inside the
+// canvas, and selects it. Returns the area of the canvas that changed.
+static Bounds selection_paste(Selection *selection, Canvas *canvas, Vector2 point) {
+    const int width = MIN(selection->clipboard.texture.width, canvas->width);
+    const int height = MIN(selection->clipboard.texture.height, canvas->height);
+    const int x = CLAMP(0, (int)floorf(point.x), canvas->width - width);
+    const int y = CLAMP(0, (int)floorf(point.y), canvas->height - height);
+    selection->bounds = (Bounds){x, y, x + width, y + height};
+    canvas_blit_from(selection->clipboard, canvas, selection->bounds);
+    return selection->bounds;
+}
+
+// Draws the floating pixels and the outline of the selection over the canvas
+static void selection_draw(const Selection *selection, float view_x, float view_y, float zoom) {
+    if (bounds_is_empty(selection->bounds))
+        return;
+    const Bounds b = selection_target(selection);
+    const Rectangle rect = {(b.x0 - view_x)*zoom, (b.y0 - view_y)*zoom,
+                            (b.x1 - b.x0)*zoom, (b.y1 - b.y0)*zoom};
+    if (selection->drag == SELECTION_MOVE) {
+        // Upper layers hold premultiplied colors
+        BeginBlendMode(BLEND_ALPHA_PREMULTIPLY);
+        DrawTexturePro(selection->floating.texture, (Rectangle){0, 0, b.x1 - b.x0, b.y1 - b.y0}, rect,
+                       (Vector2){0, 0}, 0.0f, WHITE);
+        EndBlendMode();
+    }
+    DrawRectangleLinesEx(rect, 1.0f, WHITE);
+}
+
+static void selection_unload(Selection *selection) {
+    if (selection->floating.id != 0)
+        UnloadRenderTexture(selection->floating);
+    if (selection->clipboard.id != 0)
+        UnloadRenderTexture(selection->clipboard);
+}
+
+//
+// StrokeBuffer: Input samples of the current stroke in canvas coordinates,
+//               starting at the last point already drawn. Samples collected
+//               during a frame are drawn together as one batch. Smoothed
+//               strokes run through the samples on a centripetal Catmull-Rom
+//               spline, flattened into as few segments as its curvature
+//               allows: one per sample on straight runs, more on curves.
+//
+// points: Array of `count` points to draw through, the samples themselves
+//         unless smoothing.
+// radii: Brush radius at each point, scaled by pen pressure.
+// capacity: Number of points `points` and `radii` have room for.
+// smooth: Whether samples are joined by the spline instead of straight.
+// controls, control_radii, control_count: The last samples when smoothing.
+//     The spline has been added to `points` up to the second to last one,
+//     the segment to the last sample needs the one after it to be shaped,
+//     so it trails a sample behind until stroke_buffer_finish().
+//
+typedef struct StrokeBuffer {
+    Vector2 *points;
+    float *radii;
+    size_t count;
+    size_t capacity;
+    bool smooth;
+    Vector2 controls[3];
+    float control_radii[3];
+    int control_count;
+} StrokeBuffer;
+
+static void stroke_buffer_append(StrokeBuffer *stroke, Vector2 point, float radius) {
+    if (stroke->count == stroke->capacity) {
+        stroke->capacity = MAX(64, 2*stroke->capacity);
+        stroke->points = realloc(stroke->points, stroke->capacity*sizeof(Vector2));
+        stroke->radii = realloc(stroke->radii, stroke->capacity*sizeof(float));
+    }
+    stroke->points[stroke->count] = point;
+    stroke->radii[stroke->count] = radius;
+    ++stroke->count;
+}
+
+// Appends the spline segment from p1 to p2, p0 and p3 being the samples
+// around it. The segment is converted to a cubic Bezier and split into the
+// number of lines Wang's formula gives for staying within a tolerance that
+// grows with the brush radius, since wider strokes hide more of the error.
+static void stroke_buffer_spline(StrokeBuffer *stroke, Vector2 p0, Vector2 p1, Vector2 p2, Vector2 p3,
+                                 float r1, float r2) {
+    // Centripetal knot spacing, consecutive controls are kept at least
+    // STROKE_MIN_SPACING apart so none of these are 0
+    const float d01 = sqrtf(Vector2Length(Vector2Subtract(p1, p0)));
+    const float d12 = sqrtf(Vector2Length(Vector2Subtract(p2, p1)));
+    const float d23 = sqrtf(Vector2Length(Vector2Subtract(p3, p2)));
+    const Vector2 m1 = Vector2Scale(Vector2Add(Vector2Subtract(Vector2Scale(Vector2Subtract(p1, p0), 1.0f/d01),
+                                                               Vector2Scale(Vector2Subtract(p2, p0), 1.0f/(d01 + d12))),
+                                               Vector2Scale(Vector2Subtract(p2, p1), 1.0f/d12)),
+                                    d12/3.0f);
+    const Vector2 m2 = Vector2Scale(Vector2Add(Vector2Subtract(Vector2Scale(Vector2Subtract(p2, p1), 1.0f/d12),
+                                                               Vector2Scale(Vector2Subtract(p3, p1), 1.0f/(d12 + d23))),
+                                               Vector2Scale(Vector2Subtract(p3, p2), 1.0f/d23)),
+                                    d12/3.0f);
+    const Vector2 b1 = Vector2Add(p1, m1);
+    const Vector2 b2 = Vector2Subtract(p2, m2);
+
+    const float curvature = MAX(Vector2Length(Vector2Add(Vector2Subtract(p1, Vector2Scale(b1, 2.0f)), b2)),
+                                Vector2Length(Vector2Add(Vector2Subtract(b1, Vector2Scale(b2, 2.0f)), p2)));
+    const float tolerance = CLAMP(0.1f, 0.05f*MAX(r1, r2), 1.0f);
+    const int segments = CLAMP(1, (int)ceilf(sqrtf(0.75f*curvature/tolerance)), STROKE_MAX_SUBDIVISIONS);
+    for (int i = 1; i <= segments; ++i) {
+        const float t = (float)i/segments;
+        const float u = 1.0f - t;
+        const Vector2 point = {
+            u*u*u*p1.x + 3.0f*u*u*t*b1.x + 3.0f*u*t*t*b2.x + t*t*t*p2.x,
+            u*u*u*p1.y + 3.0f*u*u*t*b1.y + 3.0f*u*t*t*b2.y + t*t*t*p2.y,
+        };
+        stroke_buffer_append(stroke, point, u*r1 + t*r2);
+    }
+}
+
+// Reflection of `b` through `a`, stands in for the sample missing before
+// the first and after the last one
+static inline Vector2 stroke_buffer_mirror(Vector2 a, Vector2 b) {
+    return Vector2Subtract(Vector2Scale(a, 2.0f), b);
+}
+
+static void stroke_buffer_push(StrokeBuffer *stroke, Vector2 point, float radius) {
+    // Samples a tablet delivers faster than the pen moves would only redraw
+    // the same disc, so they're merged into the last one unless that has
+    // already been drawn
+    if (!stroke->smooth) {
+        if (stroke->count > 0 && Vector2LengthSqr(Vector2Subtract(stroke->points[stroke->count - 1], point)) <
+                                 STROKE_MIN_SPACING*STROKE_MIN_SPACING) {
+            if (stroke->count > 1) {
+                stroke->points[stroke->count - 1] = point;
+                stroke->radii[stroke->count - 1] = radius;
+            }
+            return;
+        }
+        stroke_buffer_append(stroke, point, radius);
+        return;
+    }
+
+    // The first sample is drawn right away, the spline only adds points up
+    // to the sample before the last one
+    int n = stroke->control_count;
+    if (n == 0) {
+        stroke_buffer_append(stroke, point, radius);
+    } else if (Vector2LengthSqr(Vector2Subtract(stroke->controls[n - 1], point)) <
+               STROKE_MIN_SPACING*STROKE_MIN_SPACING) {
+        // A merge must not walk the last control back onto the one before,
+        // the sample is dropped instead
+        if (n > 1 && Vector2LengthSqr(Vector2Subtract(stroke->controls[n - 2], point)) >=
+                     STROKE_MIN_SPACING*STROKE_MIN_SPACING) {
+            stroke->controls[n - 1] = point;
+            stroke->control_radii[n - 1] = radius;
+        }
+        return;
+    } else if (n >= 2) {
+        const Vector2 p1 = stroke->controls[n - 2];
+        const Vector2 p2 = stroke->controls[n - 1];
+        const Vector2 p0 = (n == 3) ? stroke->controls[0] : stroke_buffer_mirror(p1, p2);
+        stroke_buffer_spline(stroke, p0, p1, p2, point, stroke->control_radii[n - 2], stroke->control_radii[n - 1]);
+        if (n == 3) {
+            memmove(stroke->controls, stroke->controls + 1, 2*sizeof(Vector2));
+            memmove(stroke->control_radii, stroke->control_radii + 1, 2*sizeof(float));
+            --n;
+        }
+    }
+    stroke->controls[n] = point;
+    stroke->control_radii[n] = radius;
+    stroke->control_count = n + 1;
+}
+
+// Adds the segment to the last sample that smoothing held back, returns
+// whether there was one
+static bool stroke_buffer_finish(StrokeBuffer *stroke) {
+    const int n = stroke->control_count;
+    stroke->control_count = 0;
+    if (n < 2)
+        return false;
+    const Vector2 p1 = stroke->controls[n - 2];
+    const Vector2 p2 = stroke->controls[n - 1];
+    const Vector2 p0 = (n == 3) ? stroke->controls[0] : stroke_buffer_mirror(p1, p2);
+    stroke_buffer_spline(stroke, p0, p1, p2, stroke_buffer_mirror(p2, p1),
+                         stroke->control_radii[n - 2], stroke->control_radii[n - 1]);
+    return true;
+}
+
+// Forgets the stroke once it has been drawn
+static inline void stroke_buffer_reset(StrokeBuffer *stroke) {
+    stroke->count = 0;
+    stroke->control_count = 0;
+}
+
+// Drops the samples that have been drawn, keeping the last one to continue
+// the stroke from
+static inline void stroke_buffer_advance(StrokeBuffer *stroke) {
+    if (stroke->count > 1) {
+        stroke->points[0] = stroke->points[stroke->count - 1];
+        stroke->radii[0] = stroke->radii[stroke->count - 1];
+        stroke->count = 1;
+    }
+}
+
+// Radius of the segment starting at sample `i`, rounded to a quarter pixel
+// so that runs of segments can share a batch
+static inline float stroke_buffer_radius(const StrokeBuffer *stroke, size_t i) {
+    const float radius = (i + 1 < stroke->count) ? 0.5f*(stroke->radii[i] + stroke->radii[i + 1])
+                                                 : stroke->radii[i];
+    return MAX(0.25f, roundf(4.0f*radius)/4.0f);
+}
+
+static void stroke_buffer_free(StrokeBuffer *stroke) {
+    free(stroke->points);
+    free(stroke->radii);
+    *stroke = (StrokeBuffer){0};
+}
+
+#endif // BEAK_NO_MAIN
+
+//
+// Run-length encoding of pixels as a sequence of 16-bit headers. A header
+// with RLE_RUN_BIT set is followed by a single pixel repeated
+// (header & RLE_MAX_LENGTH) times, otherwise it is followed by `header`
+// literal pixels. Headers are not aligned so they're accessed with memcpy.
+//
+#define RLE_RUN_BIT 0x8000
+#define RLE_MAX_LENGTH 0x7fff
+
+// Upper bound on the encoded size of `count` pixels. Runs always save more
+// than the header of the literal following them, so only literals split
+// at RLE_MAX_LENGTH add to the raw size.
+static inline size_t rle_bound(size_t count) {
+    return count*sizeof(Color) + (count/RLE_MAX_LENGTH + 2)*sizeof(uint16_t);
+}
+
+static size_t rle_encode(const Color *pixels, size_t count, unsigned char *out) {
+    unsigned char *p = out;
+    size_t i = 0;
+    while (i < count) {
+        size_t run = 1;
+        while (i + run < count && run < RLE_MAX_LENGTH && color_equal(pixels[i + run], pixels[i]))
+            ++run;
+
+        // Runs shorter than 3 pixels are cheaper to store as literals
+        if (run >= 3) {
+            const uint16_t header = RLE_RUN_BIT | run;
+            memcpy(p, &header, sizeof(header));
+            memcpy(p + sizeof(header), &pixels[i], sizeof(Color));
+            p += sizeof(header) + sizeof(Color);
+            i += run;
+            continue;
+        }
+
+        // Extend the literal until the next run worth encoding
+        const size_t start = i;
+        while (i < count && i - start < RLE_MAX_LENGTH) {
+            if (i + 2 < count && color_equal(pixels[i], pixels[i + 1]) && color_equal(pixels[i], pixels[i + 2]))
+                break;
+            ++i;
+        }
+        const uint16_t header = i - start;
+        memcpy(p, &header, sizeof(header));
+        memcpy(p + sizeof(header), &pixels[start], header*sizeof(Color));
+        p += sizeof(header) + header*sizeof(Color);
+    }
+    return p - out;
+}
+
+// Decodes up to `count` pixels, returns how many there were
+static size_t rle_decode(const unsigned char *data, size_t size, Color *pixels, size_t count) {
+    const unsigned char *end = data + size;
+    size_t i = 0;
+    // Truncated data, which peers could send, decodes as far as it goes
+    while (end - data >= (ptrdiff_t)sizeof(uint16_t) && i < count) {
+        uint16_t header;
+        memcpy(&header, data, sizeof(header));
+        data += sizeof(header);
+
+        size_t length = MIN((size_t)(header & RLE_MAX_LENGTH), count - i);
+        if (header & RLE_RUN_BIT) {
+            if (end - data < (ptrdiff_t)sizeof(Color))
+                break;
+            Color color;
+            memcpy(&color, data, sizeof(color));
+            data += sizeof(color);
+            for (size_t j = 0; j < length; ++j)
+                pixels[i + j] = color;
+        } else {
+            length = MIN(length, (size_t)(end - data)/sizeof(Color));
+            memcpy(&pixels[i], data, length*sizeof(Color));
+            data += length*sizeof(Color);
+        }
+        i += length;
+    }
+    return i;
+}
+
+//
+// CompressJob: Request for the compressor thread to encode the pixels of an
+//              undo entry.
+//
+// entry: Index of the undo entry the pixels belong to.
+// pixels, count: Pixels to encode, left untouched by the main thread until
+//                the job is done.
+// data, size: Encoded pixels, written by the compressor thread into a
+//             buffer of rle_bound(count) bytes from the main thread.
+//
+typedef struct CompressJob {
+    size_t entry;
+    const Color *pixels;
+    size_t count;
+    unsigned char *data;
+    size_t size;
+} CompressJob;
+
+//
+// Compressor: Background thread run-length encoding undo entries after they
+//             are pushed. Canvases are mostly flat color so this lets the
+//             same amount of memory hold many more undo states.
+//
+// thread: The compressor thread.
+// running: Whether the thread was started, otherwise nothing is compressed.
+// mutex: Protects the counters, `quit` and the jobs between `completed` and
+//        `submitted`.
+// job_added: Signaled by the main thread when a job is submitted.
+// job_done: Signaled by the compressor thread when a job is completed.
+// jobs: Ring buffer of jobs, indexed by the counters modulo its size.
+// submitted: Number of jobs submitted by the main thread.
+// completed: Number of jobs completed by the compressor thread.
+// collected: Number of completed jobs collected by the main thread.
+// quit: Tells the compressor thread to exit.
+//
+typedef struct Compressor {
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_added;
+    pthread_cond_t job_done;
+    CompressJob jobs[MAX_COMPRESS_JOBS];
+    size_t submitted;
+    size_t completed;
+    size_t collected;
+    bool quit;
+} Compressor;
+
+static void *compressor_main(void *arg) {
+    Compressor *compressor = arg;
+    pthread_mutex_lock(&compressor->mutex);
+    for (;;) {
+        while (compressor->completed == compressor->submitted && !compressor->quit)
+            pthread_cond_wait(&compressor->job_added, &compressor->mutex);
+        if (compressor->quit)
+            break;
+
+        // Jobs are only reused once collected, so we can work on this one
+        // without holding the lock.
+        CompressJob *job = &compressor->jobs[compressor->completed % MAX_COMPRESS_JOBS];
+        pthread_mutex_unlock(&compressor->mutex);
+
+        job->size = rle_encode(job->pixels, job->count, job->data);
+
+        pthread_mutex_lock(&compressor->mutex);
+        ++compressor->completed;
+        pthread_cond_broadcast(&compressor->job_done);
+    }
+    pthread_mutex_unlock(&compressor->mutex);
+    return NULL;
+}
+
+static void compressor_start(Compressor *compressor) {
+    pthread_mutex_init(&compressor->mutex, NULL);
+    pthread_cond_init(&compressor->job_added, NULL);
+    pthread_cond_init(&compressor->job_done, NULL);
+    compressor->running = pthread_create(&compressor->thread, NULL, compressor_main, compressor) == 0;
+    if (!compressor->running)
+        fprintf(stderr, "[warning]: Failed to start compressor thread, undo log is uncompressed\n");
+}
+
+// Stops the compressor thread, completed jobs that weren't collected are
+// left as is.
+static void compressor_stop(Compressor *compressor) {
+    if (compressor->running) {
+        pthread_mutex_lock(&compressor->mutex);
+        compressor->quit = true;
+        pthread_cond_signal(&compressor->job_added);
+        pthread_mutex_unlock(&compressor->mutex);
+        pthread_join(compressor->thread, NULL);
+        compressor->running = false;
+    }
+    pthread_cond_destroy(&compressor->job_done);
+    pthread_cond_destroy(&compressor->job_added);
+    pthread_mutex_destroy(&compressor->mutex);
+}
+
+//
+// ExportJob: Request for the exporter thread to save a region of a canvas.
+//            The region is read back a band of TILE_SIZE rows at a time and
+//            each band is run-length encoded right away, like undo entries.
+//            Canvases are mostly flat color, so this holds a fraction of the
+//            image, and the encoder decodes one band at a time as it goes.
+//
+// bounds: Region of the canvas that was read back.
+// bands: Encoded pixels of each band, TILE_SIZE rows high but the last.
+// band_sizes: Size of each band in bytes.
+// band_count: Number of bands.
+// background: Background color of the canvas, what cropping crops away.
+// path: Where to save it, must outlive the job.
+//
+typedef struct ExportJob {
+    Bounds bounds;
+    unsigned char **bands;
+    size_t *band_sizes;
+    int band_count;
+    Color background;
+    const char *path;
+} ExportJob;
+
+#ifndef BEAK_NO_MAIN
+//
+// Exporter: Background thread encoding and writing saved images, so saving
+//           only costs the main thread the readback of the canvas.
+//
+// thread: The exporter thread.
+// running: Whether the thread was started, otherwise images are exported on
+//          the main thread.
+// mutex: Protects the counters, `quit` and the jobs between `completed` and
+//        `submitted`.
+// job_added: Signaled by the main thread when a job is submitted.
+// job_done: Signaled by the exporter thread when a job is completed.
+// jobs: Ring buffer of jobs, indexed by the counters modulo its size.
+// submitted: Number of jobs submitted by the main thread.
+// completed: Number of jobs completed by the exporter thread, their bands
+//            are freed by it.
+// quit: Tells the exporter thread to exit once all jobs are completed.
+// level: zlib compression level of saved PNGs, 0-9 from fast to small.
+// crop: Whether images are cropped to their painted pixels.
+//
+typedef struct Exporter {
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_added;
+    pthread_cond_t job_done;
+    ExportJob jobs[MAX_EXPORT_JOBS];
+    size_t submitted;
+    size_t completed;
+    bool quit;
+    int level;
+    bool crop;
+} Exporter;
+
+#endif // BEAK_NO_MAIN
+
+// Reads back the region `bounds` of canvas for saving to `path`. Only the
+// tiles that were painted are read back when cropping.
+static ExportJob export_read(const Canvas *canvas, Bounds bounds, const char *path, bool crop) {
+    if (crop) {
+        Bounds allocated = BOUNDS_EMPTY;
+        for (int ty = 0; ty < canvas->tiles_y; ++ty)
+            for (int tx = 0; tx < canvas->tiles_x; ++tx)
+                if (canvas_has_tile(canvas, tx, ty))
+                    allocated = bounds_union(allocated, tile_bounds(tx, ty));
+        // Nothing painted still saves the background
+        if (!bounds_is_empty(bounds_intersect(bounds, allocated)))
+            bounds = bounds_intersect(bounds, allocated);
+    }
+
+    const int width = bounds.x1 - bounds.x0;
+    ExportJob job = {
+        .bounds = bounds,
+        .band_count = (bounds.y1 - bounds.y0 + TILE_SIZE - 1)/TILE_SIZE,
+        .background = canvas->background,
+        .path = path,
+    };
+    job.bands = malloc(job.band_count*sizeof(unsigned char *));
+    job.band_sizes = malloc(job.band_count*sizeof(size_t));
+    Color *pixels = malloc((size_t)width*TILE_SIZE*sizeof(Color));
+    unsigned char *data = malloc(rle_bound((size_t)width*TILE_SIZE));
+    for (int i = 0; i < job.band_count; ++i) {
+        const Bounds band = {bounds.x0, bounds.y0 + i*TILE_SIZE, bounds.x1, MIN(bounds.y0 + (i + 1)*TILE_SIZE, bounds.y1)};
+        canvas_read_pixels(canvas, band, pixels);
+        job.band_sizes[i] = rle_encode(pixels, (size_t)width*(band.y1 - band.y0), data);
+        job.bands[i] = malloc(job.band_sizes[i]);
+        memcpy(job.bands[i], data, job.band_sizes[i]);
+    }
+    free(data);
+    free(pixels);
+    return job;
+}
+
+// Bounds of the `count` pixels from `index` on in band `band` of the job
+static Bounds export_span(const ExportJob *job, int band, size_t index, size_t count) {
+    const size_t width = job->bounds.x1 - job->bounds.x0;
+    const int y0 = job->bounds.y0 + band*TILE_SIZE + index/width;
+    const int y1 = job->bounds.y0 + band*TILE_SIZE + (index + count - 1)/width + 1;
+    if (y1 - y0 > 1)
+        return (Bounds){job->bounds.x0, y0, job->bounds.x1, y1};
+    return (Bounds){job->bounds.x0 + index%width, y0, job->bounds.x0 + (index + count - 1)%width + 1, y1};
+}
+
+// Bounds of the pixels that aren't the background color, empty if there are
+// none. Works on the encoded bands, so runs of background cost nothing.
+static Bounds export_painted(const ExportJob *job) {
+    Bounds painted = BOUNDS_EMPTY;
+    for (int i = 0; i < job->band_count; ++i) {
+        const unsigned char *data = job->bands[i];
+        const unsigned char *end = data + job->band_sizes[i];
+        size_t index = 0;
+        while (end - data >= (ptrdiff_t)sizeof(uint16_t)) {
+            uint16_t header;
+            memcpy(&header, data, sizeof(header));
+            data += sizeof(header);
+            const size_t length = header & RLE_MAX_LENGTH;
+            if (header & RLE_RUN_BIT) {
+                Color color;
+                memcpy(&color, data, sizeof(color));
+                data += sizeof(color);
+                if (!color_equal(color, job->background))
+                    painted = bounds_union(painted, export_span(job, i, index, length));
+            } else {
+                // Only the first and last painted pixel of the run matter
+                size_t first = length, last = 0;
+                for (size_t j = 0; j < length; ++j) {
+                    Color color;
+                    memcpy(&color, data + j*sizeof(Color), sizeof(color));
+                    if (!color_equal(color, job->background)) {
+                        first = MIN(first, j);
+                        last = j;
+                    }
+                }
+                if (first < length)
+                    painted = bounds_union(painted, export_span(job, i, index + first, last - first + 1));
+                data += length*sizeof(Color);
+            }
+            index += length;
+        }
+    }
+    return painted;
+}
+
+static void export_free(ExportJob *job) {
+    for (int i = 0; i < job->band_count; ++i)
+        free(job->bands[i]);
+    free(job->bands);
+    free(job->band_sizes);
+    *job = (ExportJob){0};
+}
+
+static inline void png_write_u32(unsigned char *out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static void png_write_chunk(FILE *file, const char *type, const unsigned char *data, size_t size) {
+    unsigned char header[8];
+    png_write_u32(header, size);
+    memcpy(header + 4, type, 4);
+    // crc32() with a NULL buffer returns the initial value instead
+    uLong crc = crc32(0, header + 4, 4);
+    if (size > 0)
+        crc = crc32(crc, data, size);
+    unsigned char footer[4];
+    png_write_u32(footer, crc);
+    fwrite(header, 1, sizeof(header), file);
+    if (size > 0)
+        fwrite(data, 1, size, file);
+    fwrite(footer, 1, sizeof(footer), file);
+}
+
+static inline unsigned char png_paeth(int a, int b, int c) {
+    const int p = a + b - c;
+    const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+// Filters a row of `size` bytes into out[1..size], with the filter type in
+// out[0]. Above level 1 each filter is tried and the one with the smallest
+// sum of absolute differences kept, which is what libpng does as well.
+static void png_filter_row(const unsigned char *row, const unsigned char *prev, size_t size, int level,
+                           unsigned char *out, unsigned char *scratch) {
+    out[0] = 0;
+    memcpy(out + 1, row, size);
+    if (level <= 1)
+        return;
+    unsigned long best = ULONG_MAX;
+    for (int filter = 0; filter < 5; ++filter) {
+        unsigned long sum = 0;
+        for (size_t i = 0; i < size; ++i) {
+            const int a = (i >= 4) ? row[i - 4] : 0;
+            const int b = (prev != NULL) ? prev[i] : 0;
+            const int c = (i >= 4 && prev != NULL) ? prev[i - 4] : 0;
+            const unsigned char predicted = (filter == 1) ? a : (filter == 2) ? b :
+                                            (filter == 3) ? (a + b)/2 : (filter == 4) ? png_paeth(a, b, c) : 0;
+            scratch[i] = row[i] - predicted;
+            sum += abs((signed char)scratch[i]);
+        }
+        if (sum < best) {
+            best = sum;
+            out[0] = filter;
+            memcpy(out + 1, scratch, size);
+        }
+    }
+}
+
+// Deflates the input of `stream`, writing an IDAT chunk whenever the `size`
+// bytes of `out` fill up. Finishing writes out everything that is left.
+static void png_deflate(FILE *file, z_stream *stream, unsigned char *out, size_t size, bool finish) {
+    int status;
+    do {
+        status = deflate(stream, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (stream->avail_out == 0 || status == Z_STREAM_END) {
+            png_write_chunk(file, "IDAT", out, size - stream->avail_out);
+            stream->next_out = out;
+            stream->avail_out = size;
+        }
+    } while (status != Z_STREAM_ERROR && (stream->avail_in > 0 || (finish && status != Z_STREAM_END)));
+}
+
+// Streams the region `crop` of the job to a PNG, deflating a row at a time
+// as the bands are decoded
+static bool export_png(const ExportJob *job, Bounds crop, int level) {
+    FILE *file = fopen(job->path, "wb");
+    if (file == NULL)
+        return false;
+
+    const int band_width = job->bounds.x1 - job->bounds.x0;
+    const size_t row_size = (size_t)(crop.x1 - crop.x0)*sizeof(Color);
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, file);
+    unsigned char ihdr[13] = {0};
+    png_write_u32(ihdr, crop.x1 - crop.x0);
+    png_write_u32(ihdr + 4, crop.y1 - crop.y0);
+    ihdr[8] = 8;
+    ihdr[9] = 6;
+    png_write_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+    z_stream stream = {0};
+    if (deflateInit(&stream, level) != Z_OK) {
+        fprintf(stderr, "[error]: Failed to start compressing '%s'\n", job->path);
+        fclose(file);
+        return false;
+    }
+    unsigned char out[1 << 16];
+    stream.next_out = out;
+    stream.avail_out = sizeof(out);
+
+    Color *pixels = malloc((size_t)band_width*TILE_SIZE*sizeof(Color));
+    unsigned char *filtered = malloc(1 + row_size);
+    unsigned char *scratch = malloc(row_size);
+    unsigned char *prev = malloc(row_size);
+    for (int i = (crop.y0 - job->bounds.y0)/TILE_SIZE; i <= (crop.y1 - 1 - job->bounds.y0)/TILE_SIZE; ++i) {
+        const int y0 = job->bounds.y0 + i*TILE_SIZE;
+        const int rows = MIN(TILE_SIZE, job->bounds.y1 - y0);
+        rle_decode(job->bands[i], job->band_sizes[i], pixels, (size_t)band_width*rows);
+        for (int y = MAX(crop.y0, y0); y < MIN(crop.y1, y0 + rows); ++y) {
+            const unsigned char *row = (const unsigned char *)&pixels[(y - y0)*band_width + (crop.x0 - job->bounds.x0)];
+            // Rows are filtered against the one above, the previous band's
+            // last row is gone by the time its first is decoded
+            png_filter_row(row, (y > crop.y0) ? prev : NULL, row_size, level, filtered, scratch);
+            memcpy(prev, row, row_size);
+            stream.next_in = filtered;
+            stream.avail_in = 1 + row_size;
+            png_deflate(file, &stream, out, sizeof(out), y == crop.y1 - 1);
+        }
+    }
+    deflateEnd(&stream);
+    free(prev);
+    free(scratch);
+    free(filtered);
+    free(pixels);
+
+    png_write_chunk(file, "IEND", NULL, 0);
+    const bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+// Saves the job, cropped to its painted pixels if `crop` is set. PNGs are
+// streamed, other formats raylib knows are decoded into an image first.
+static bool export_write(const ExportJob *job, int level, bool crop) {
+    const Bounds painted = crop ? export_painted(job) : BOUNDS_EMPTY;
+    const Bounds crop_bounds = !bounds_is_empty(painted) ? painted : job->bounds;
+    bool ok;
+    if (IsFileExtension(job->path, ".png")) {
+        ok = export_png(job, crop_bounds, level);
+    } else {
+        const int band_width = job->bounds.x1 - job->bounds.x0;
+        Image image = alloc_image(crop_bounds.x1 - crop_bounds.x0, crop_bounds.y1 - crop_bounds.y0);
+        Color *pixels = malloc((size_t)band_width*TILE_SIZE*sizeof(Color));
+        for (int i = 0; i < job->band_count; ++i) {
+            const int y0 = job->bounds.y0 + i*TILE_SIZE;
+            const int rows = MIN(TILE_SIZE, job->bounds.y1 - y0);
+            if (y0 + rows <= crop_bounds.y0 || y0 >= crop_bounds.y1)
+                continue;
+            rle_decode(job->bands[i], job->band_sizes[i], pixels, (size_t)band_width*rows);
+            for (int y = MAX(crop_bounds.y0, y0); y < MIN(crop_bounds.y1, y0 + rows); ++y)
+                memcpy((Color *)image.data + (size_t)(y - crop_bounds.y0)*image.width,
+                       &pixels[(y - y0)*band_width + (crop_bounds.x0 - job->bounds.x0)],
+                       image.width*sizeof(Color));
+        }
+        free(pixels);
+        ok = ExportImage(image, job->path);
+        UnloadImage(image);
+    }
+    if (!ok)
+        fprintf(stderr, "[error]: Failed to save image to '%s'\n", job->path);
+    return ok;
+}
+
+#ifndef BEAK_NO_MAIN
+static void *exporter_main(void *arg) {
+    Exporter *exporter = arg;
+    pthread_mutex_lock(&exporter->mutex);
+    for (;;) {
+        while (exporter->completed == exporter->submitted && !exporter->quit)
+            pthread_cond_wait(&exporter->job_added, &exporter->mutex);
+        if (exporter->completed == exporter->submitted)
+            break;
+
+        // Jobs are only reused once completed, so we can work on this one
+        // without holding the lock.
+        ExportJob job = exporter->jobs[exporter->completed % MAX_EXPORT_JOBS];
+        pthread_mutex_unlock(&exporter->mutex);
+
+        export_write(&job, exporter->level, exporter->crop);
+        export_free(&job);
+
+        pthread_mutex_lock(&exporter->mutex);
+        ++exporter->completed;
+        pthread_cond_signal(&exporter->job_done);
+    }
+    pthread_mutex_unlock(&exporter->mutex);
+    return NULL;
+}
+
+static void exporter_start(Exporter *exporter) {
+    pthread_mutex_init(&exporter->mutex, NULL);
+    pthread_cond_init(&exporter->job_added, NULL);
+    pthread_cond_init(&exporter->job_done, NULL);
+    exporter->running = pthread_create(&exporter->thread, NULL, exporter_main, exporter) == 0;
+    if (!exporter->running)
+        fprintf(stderr, "[warning]: Failed to start exporter thread, saving blocks until done\n");
+}
+
+// Hands the job over to the exporter thread, which saves and frees it.
+// Only blocks if the queue is full.
+static void exporter_submit(Exporter *exporter, ExportJob job) {
+    if (!exporter->running) {
+        export_write(&job, exporter->level, exporter->crop);
+        export_free(&job);
+        return;
+    }
+    pthread_mutex_lock(&exporter->mutex);
+    while (exporter->submitted - exporter->completed == MAX_EXPORT_JOBS)
+        pthread_cond_wait(&exporter->job_done, &exporter->mutex);
+    exporter->jobs[exporter->submitted % MAX_EXPORT_JOBS] = job;
+    ++exporter->submitted;
+    pthread_cond_signal(&exporter->job_added);
+    pthread_mutex_unlock(&exporter->mutex);
+}
+
+// Stops the exporter thread after all submitted images were saved.
+static void exporter_stop(Exporter *exporter) {
+    if (exporter->running) {
+        pthread_mutex_lock(&exporter->mutex);
+        exporter->quit = true;
+        pthread_cond_signal(&exporter->job_added);
+        pthread_mutex_unlock(&exporter->mutex);
+        pthread_join(exporter->thread, NULL);
+        exporter->running = false;
+    }
+    pthread_cond_destroy(&exporter->job_done);
+    pthread_cond_destroy(&exporter->job_added);
+    pthread_mutex_destroy(&exporter->mutex);
+}
+
+//
+// Journal: Autosave of the canvas as an append-only file of tiles. Tiles
+//          dirtied since the last save are appended run-length encoded, so
+//          replaying the file from the start recovers the canvas as of the
+//          last complete record. Once the file grows to several times what
+//          its latest records take up, it is rewritten with just those.
+//
+// path: Where the journal is kept, must outlive it.
+// file: The journal file, NULL if autosaving is disabled.
+// dirty: Per tile, whether it changed since the last save.
+// dirty_count: Number of dirty tiles.
+// recorded: Per tile, whether the journal has a record of it.
+// size: Bytes written to the journal file.
+// compacted_size: Size of the journal when it was last rewritten.
+// pixels, data: Scratch space for the pixels of one tile and their encoding.
+// last_save: Time of the last save, as returned by GetTime().
+//
+typedef struct Journal {
+    const char *path;
+    FILE *file;
+    bool *dirty;
+    size_t dirty_count;
+    bool *recorded;
+    size_t size;
+    size_t compacted_size;
+    Color *pixels;
+    unsigned char *data;
+    double last_save;
+} Journal;
+
+#define JOURNAL_MAGIC "beakjnl1"
+
+// How many times its rewritten size a journal grows to before it is
+// rewritten again
+#define JOURNAL_COMPACT_RATIO 4
+
+typedef struct JournalHeader {
+    char magic[8];
+    uint32_t width, height;
+    uint32_t tile_size;
+    Color background;
+} JournalHeader;
+
+// Followed by `size` bytes of encoded pixels, or none if the tile is blank
+typedef struct JournalRecord {
+    uint32_t tx, ty;
+    uint32_t size;
+} JournalRecord;
+
+static void journal_mark(Journal *journal, const Canvas *canvas, Bounds bounds) {
+    if (journal->dirty == NULL)
+        return;
+    bounds = bounds_intersect(bounds, canvas_bounds(canvas));
+    if (bounds_is_empty(bounds))
+        return;
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            bool *dirty = &journal->dirty[ty*canvas->tiles_x + tx];
+            journal->dirty_count += !*dirty;
+            *dirty = true;
+        }
+    }
+}
+
+// Replays the journal at `path` onto the canvas, returns the changed area.
+// Missing journals are silently ignored, and records cut short by a crash
+// end the replay.
+static Bounds journal_recover(const char *path, Canvas *canvas) {
+    Bounds changed = BOUNDS_EMPTY;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return changed;
+
+    JournalHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.tile_size != TILE_SIZE) {
+        fprintf(stderr, "[warning]: '%s' is not a beak journal, not recovering\n", path);
+        fclose(file);
+        return changed;
+    }
+    if (header.width != (uint32_t)canvas->width || header.height != (uint32_t)canvas->height) {
+        fprintf(stderr, "[warning]: Journal '%s' is for a %ux%u canvas, not recovering\n",
+                path, header.width, header.height);
+        fclose(file);
+        return changed;
+    }
+
+    Color *pixels = malloc(TILE_SIZE*TILE_SIZE*sizeof(Color));
+    unsigned char *data = malloc(rle_bound(TILE_SIZE*TILE_SIZE));
+    JournalRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.tx >= (uint32_t)canvas->tiles_x || record.ty >= (uint32_t)canvas->tiles_y)
+            break;
+        const Bounds part = bounds_intersect(tile_bounds(record.tx, record.ty), canvas_bounds(canvas));
+        const size_t count = (size_t)(part.x1 - part.x0)*(part.y1 - part.y0);
+        if (record.size > rle_bound(count) || fread(data, 1, record.size, file) != record.size)
+            break;
+
+        if (record.size == 0) {
+            for (size_t i = 0; i < count; ++i)
+                pixels[i] = header.background;
+        } else {
+            rle_decode(data, record.size, pixels, count);
+        }
+        canvas_write_pixels(canvas, part, pixels);
+        changed = bounds_union(changed, part);
+    }
+
+    free(data);
+    free(pixels);
+    fclose(file);
+    return changed;
+}
+
+// Appends a record of each dirty tile. Unallocated tiles are recorded as
+// blank without reading them back.
+static void journal_append(Journal *journal, const Canvas *canvas) {
+    for (int ty = 0; ty < canvas->tiles_y; ++ty) {
+        for (int tx = 0; tx < canvas->tiles_x; ++tx) {
+            bool *dirty = &journal->dirty[ty*canvas->tiles_x + tx];
+            if (!*dirty)
+                continue;
+            *dirty = false;
+
+            JournalRecord record = {.tx = tx, .ty = ty};
+            if (canvas_has_tile(canvas, tx, ty)) {
+                const Bounds part = bounds_intersect(tile_bounds(tx, ty), canvas_bounds(canvas));
+                const size_t count = (size_t)(part.x1 - part.x0)*(part.y1 - part.y0);
+                canvas_read_pixels(canvas, part, journal->pixels);
+                record.size = rle_encode(journal->pixels, count, journal->data);
+            }
+            fwrite(&record, sizeof(record), 1, journal->file);
+            fwrite(journal->data, 1, record.size, journal->file);
+            journal->recorded[ty*canvas->tiles_x + tx] = true;
+            journal->size += sizeof(record) + record.size;
+        }
+    }
+    journal->dirty_count = 0;
+}
+
+// Writes a new journal of the tiles it has records of and the dirty ones
+// next to the journal's path, and moves it over the existing one once
+// complete, so a crash meanwhile still leaves the old one to recover from
+static bool journal_rewrite(Journal *journal, const Canvas *canvas) {
+    char *tmp_path = malloc(strlen(journal->path) + sizeof(".tmp"));
+    sprintf(tmp_path, "%s.tmp", journal->path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "[error]: Failed to open '%s' for writing\n", tmp_path);
+        free(tmp_path);
+        return false;
+    }
+
+    JournalHeader header = {
+        .width = canvas->width,
+        .height = canvas->height,
+        .tile_size = TILE_SIZE,
+        .background = canvas->background,
+    };
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, file);
+
+    const size_t tile_count = canvas_tile_count(canvas);
+    for (size_t i = 0; i < tile_count; ++i) {
+        journal->dirty_count += journal->recorded[i] && !journal->dirty[i];
+        journal->dirty[i] |= journal->recorded[i];
+    }
+    FILE *old = journal->file;
+    const size_t old_size = journal->size;
+    journal->file = file;
+    journal->size = sizeof(header);
+    journal_append(journal, canvas);
+    if (fflush(file) != 0 || rename(tmp_path, journal->path) != 0) {
+        fprintf(stderr, "[error]: Failed to write journal '%s'\n", tmp_path);
+        fclose(file);
+        remove(tmp_path);
+        free(tmp_path);
+        // The old journal lacks what was just written, so all recorded
+        // tiles are appended to it instead. Rewriting is only retried once
+        // it has grown again.
+        journal->dirty_count = 0;
+        for (size_t i = 0; i < tile_count; ++i) {
+            journal->dirty[i] = journal->recorded[i];
+            journal->dirty_count += journal->recorded[i];
+        }
+        journal->file = old;
+        journal->size = journal->compacted_size = old_size;
+        return false;
+    }
+    if (old != NULL)
+        fclose(old);
+    free(tmp_path);
+    journal->compacted_size = journal->size;
+    return true;
+}
+
+// Starts a new journal at `path` holding the `recovered` area of canvas.
+// Any existing journal is only replaced once the recovered tiles are
+// written, so crashing again right away doesn't lose them.
+static bool journal_open(Journal *journal, const Canvas *canvas, const char *path, Bounds recovered) {
+    *journal = (Journal){
+        .path = path,
+        .dirty = calloc(canvas_tile_count(canvas), sizeof(bool)),
+        .recorded = calloc(canvas_tile_count(canvas), sizeof(bool)),
+        .pixels = malloc(TILE_SIZE*TILE_SIZE*sizeof(Color)),
+        .data = malloc(rle_bound(TILE_SIZE*TILE_SIZE)),
+        .last_save = GetTime(),
+    };
+    journal_mark(journal, canvas, recovered);
+    if (!journal_rewrite(journal, canvas)) {
+        fprintf(stderr, "[error]: Failed to open journal '%s', autosave is disabled\n", path);
+        free(journal->dirty);
+        free(journal->recorded);
+        free(journal->pixels);
+        free(journal->data);
+        *journal = (Journal){0};
+        return false;
+    }
+    return true;
+}
+
+// Appends the dirty tiles to the journal, or rewrites it with them if it has
+// grown too large
+static void journal_save(Journal *journal, const Canvas *canvas) {
+    journal->last_save = GetTime();
+    if (journal->file == NULL || journal->dirty_count == 0)
+        return;
+
+    if (journal->size >= JOURNAL_COMPACT_RATIO*journal->compacted_size && journal_rewrite(journal, canvas))
+        return;
+    journal_append(journal, canvas);
+    if (fflush(journal->file) != 0)
+        fprintf(stderr, "[error]: Failed to write journal\n");
+}
+
+static void journal_close(Journal *journal) {
+    if (journal->file == NULL)
+        return;
+    fclose(journal->file);
+    free(journal->dirty);
+    free(journal->recorded);
+    free(journal->pixels);
+    free(journal->data);
+    *journal = (Journal){0};
+}
+
+#endif // BEAK_NO_MAIN
+
+//
+// Pool: Recycles the CPU pixel buffers of the undo log, so steady state
+//       drawing doesn't go through the allocator. Buffers are rounded up to
+//       one of four size classes per power of two, wasting at most a
+//       quarter, and freed buffers are kept on a free list per class.
+//
+// free: Per class list of free buffers, linked through their first bytes.
+// cached: Bytes of buffers on the free lists.
+// limit: Most bytes kept on the free lists, buffers freed past it are
+//        returned to the system.
+//
+#define POOL_CLASSES 96
+
+typedef struct Pool {
+    void *free[POOL_CLASSES];
+    size_t cached;
+    size_t limit;
+} Pool;
+
+// Classes start at 1 KiB
+static inline size_t pool_class_size(int c) {
+    return (size_t)(4 + c%4) << (c/4 + 8);
+}
+
+static inline int pool_class(size_t size) {
+    int c = 0;
+    while (pool_class_size(c) < size)
+        ++c;
+    assert(c < POOL_CLASSES);
+    return c;
+}
+
+static void *pool_alloc(Pool *pool, size_t size) {
+    const int c = pool_class(size);
+    void *buffer = pool->free[c];
+    if (buffer == NULL)
+        return malloc(pool_class_size(c));
+    memcpy(&pool->free[c], buffer, sizeof(void *));
+    pool->cached -= pool_class_size(c);
+    return buffer;
+}
+
+// `size` has to be the size the buffer was allocated with
+static void pool_free(Pool *pool, void *buffer, size_t size) {
+    if (buffer == NULL)
+        return;
+    const int c = pool_class(size);
+    if (pool->cached + pool_class_size(c) > pool->limit) {
+        free(buffer);
+        return;
+    }
+    memcpy(buffer, &pool->free[c], sizeof(void *));
+    pool->free[c] = buffer;
+    pool->cached += pool_class_size(c);
+}
+
+static void pool_release(Pool *pool) {
+    for (int c = 0; c < POOL_CLASSES; ++c) {
+        while (pool->free[c] != NULL) {
+            void *buffer = pool->free[c];
+            memcpy(&pool->free[c], buffer, sizeof(void *));
+            free(buffer);
+        }
+    }
+    pool->cached = 0;
+}
+
+static inline Image pool_alloc_image(Pool *pool, int width, int height) {
+    Image image = alloc_image(0, 0);
+    image.data = pool_alloc(pool, (size_t)width*height*sizeof(Color));
+    image.width = width;
+    image.height = height;
+    return image;
+}
+
+static inline void pool_free_image(Pool *pool, Image *image) {
+    pool_free(pool, image->data, (size_t)image->width*image->height*sizeof(Color));
+    image->data = NULL;
+}
+
+//
+// UndoEntry: A single change to the canvas.
+//
+// x, y: Position of the changed region in canvas coordinates.
+// width, height: Size of the changed region.
+// image: CPU copy of the pixels of the changed region. Holds the pixels from
+//        before the change while the entry is applied, and the pixels from
+//        after the change once it has been undone.
+// texture: GPU copy of the same pixels, used instead of `image` when the log
+//          is kept resident on the GPU. An entry being spilled to the CPU has
+//          both until its readback is harvested.
+// compressed: Run-length encoded copy of the CPU pixels, replaces `image`
+//             once the compressor is done with it.
+// compressed_size: Size of `compressed` in bytes.
+// clear: Whether the entry clears the whole canvas. Instead of copying pixels
+//        the tile arrays of the canvas and its copy are swapped with
+//        `tiles` and `copy_tiles`/`committed_tiles`, so these hold the tiles
+//        from before the clear while it is applied.
+//
+typedef struct UndoEntry {
+    int x, y;
+    int width, height;
+    Image image;
+    RenderTexture2D texture;
+    unsigned char *compressed;
+    size_t compressed_size;
+
+    bool clear;
+    RenderTexture2D *tiles;
+    RenderTexture2D *committed_tiles;
+    Color **copy_tiles;
+} UndoEntry;
+
+//
+// Readback: An asynchronous GPU->CPU copy of an undo entry. The pixels are
+//           read into a pixel buffer object and a fence is inserted after
+//           the read, once the fence is signaled the pixels can be mapped
+//           without stalling the render loop.
+//
+// pbo: Pixel buffer object the pixels are read into.
+// capacity: Size of the pbo in bytes.
+// fence: Signaled when the read has completed.
+// entry: Index of the undo entry the pixels belong to.
+// spill: Whether the pixels are read from the entry texture to move it to
+//        the CPU, rather than from the canvas for a new change.
+//
+typedef struct Readback {
+    GLuint pbo;
+    size_t capacity;
+    GLsync fence;
+    size_t entry;
+    bool spill;
+} Readback;
+
+//
+// UndoLog: Storage for all previous changes you can get to via
+//          undo/redo actions. Instead of storing full copies of the canvas
+//          we store one UndoEntry for each change, holding only the region
+//          that was touched.
+//
+// canvas: The canvas changes are made to.
+// copy: CPU copy of the canvas tiles as of the most recently harvested entry,
+//       NULL tiles are the background color. Entries are swapped in/out of
+//       this on undo/redo, so we never have to read back the canvas to undo.
+// committed: GPU copy of the canvas as of the most recent entry, used
+//            instead of `copy` when the log is kept resident on the GPU.
+//            Only one of `copy` and `committed` is allocated.
+// entries: Array of `size` changes describing undo states. Only `capacity`
+//          of them are allocated, the array grows as entries are pushed so
+//          a large --undo-log-size costs nothing until it is used.
+// used_size: Number of entries actually used.
+// top: Index of most recent entry pushed (note this will wrap).
+// selected: Index of the currently selected entry. Used to keep track of which
+//           entry is being viewed.
+// async: Whether entries are read back asynchronously using `readbacks`,
+//        requires fences which are missing before OpenGL 3.2.
+// readbacks: Queue of in-flight readbacks, harvested in the order they were
+//            pushed since each one is swapped into `copy`.
+// readback_first: Index of the oldest in-flight readback.
+// readback_count: Number of in-flight readbacks.
+// vram_budget: Bytes of entry textures allowed on the GPU before the oldest
+//              ones are spilled to the CPU. Tiles kept by clear entries are
+//              not counted.
+// vram_used: Bytes of entry textures currently on the GPU.
+// stale: Number of entries from `top` on that were cut off by drawing after
+//        an undo. They can't be reached anymore, but are only unloaded a
+//        frame at a time or when their slot is pushed to.
+// compressor: Compresses entries once their CPU pixels are final, entries
+//             are decompressed again when undone/redone.
+// pool: Where all CPU pixels of entries and of `copy` are allocated from.
+//
+// Since we can never undo past the oldest entry in the log, its pixels are
+// never needed and get freed as soon as it becomes the oldest.
+//
+typedef struct UndoLog {
+    Canvas *canvas;
+    Color **copy;
+    Canvas committed;
+    UndoEntry *entries;
+    size_t size;
+    size_t capacity;
+    size_t used_size;
+    size_t top;
+    size_t selected;
+    size_t stale;
+
+    bool async;
+    Readback readbacks[MAX_READBACKS];
+    size_t readback_first;
+    size_t readback_count;
+
+    size_t vram_budget;
+    size_t vram_used;
+
+    Compressor compressor;
+    Pool pool;
+} UndoLog;
+
+static inline bool undo_log_on_gpu(const UndoLog *log) {
+    return log->committed.tiles != NULL;
+}
+
+static inline Bounds undo_entry_bounds(const UndoEntry *entry) {
+    return (Bounds){entry->x, entry->y, entry->x + entry->width, entry->y + entry->height};
+}
+
+// Approximate VRAM used by an entry texture, raylib render textures come
+// with a depth attachment of the same size.
+static inline size_t undo_entry_vram(const UndoEntry *entry) {
+    return 2*(size_t)entry->width*entry->height*sizeof(Color);
+}
+
+// Frees an array of CPU tiles, NULL tiles are skipped
+static void free_copy_tiles(Pool *pool, Color **tiles, size_t count) {
+    if (tiles == NULL)
+        return;
+    for (size_t i = 0; i < count; ++i)
+        pool_free(pool, tiles[i], TILE_SIZE*TILE_SIZE*sizeof(Color));
+    free(tiles);
+}
+
+// Swap the pixels of entry with the region of the canvas copy it covers
+static void undo_entry_swap(UndoLog *log, UndoEntry *entry) {
+    const Canvas *canvas = log->canvas;
+    const Bounds bounds = undo_entry_bounds(entry);
+    Color *pixels = entry->image.data;
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            const Bounds part = bounds_intersect(bounds, tile_bounds(tx, ty));
+            Color *src = &pixels[(part.y0 - bounds.y0)*entry->width + (part.x0 - bounds.x0)];
+            Color **tile = &log->copy[ty*canvas->tiles_x + tx];
+
+            // Unallocated copy tiles are the background, so swapping in more
+            // background is a no-op. Otherwise allocate them on demand.
+            if (*tile == NULL) {
+                if (pixels_are_color(src, entry->width, part.x1 - part.x0, part.y1 - part.y0, canvas->background))
+                    continue;
+                *tile = pool_alloc(&log->pool, TILE_SIZE*TILE_SIZE*sizeof(Color));
+                for (size_t i = 0; i < TILE_SIZE*TILE_SIZE; ++i)
+                    (*tile)[i] = canvas->background;
+            }
+
+            for (int y = part.y0; y < part.y1; ++y) {
+                Color *row = &src[(y - part.y0)*entry->width];
+                Color *tile_row = &(*tile)[(y - ty*TILE_SIZE)*TILE_SIZE + (part.x0 - tx*TILE_SIZE)];
+                for (int x = 0; x < part.x1 - part.x0; ++x) {
+                    Color tmp = row[x];
+                    row[x] = tile_row[x];
+                    tile_row[x] = tmp;
+                }
+            }
+        }
+    }
+}
+
+// Installs the results of completed compression jobs. If the entry at
+// `index` is being compressed, blocks until it is done first.
+static void undo_log_collect(UndoLog *log, size_t index) {
+    Compressor *compressor = &log->compressor;
+    if (!compressor->running)
+        return;
+
+    pthread_mutex_lock(&compressor->mutex);
+    for (size_t i = compressor->collected; i < compressor->submitted; ++i) {
+        if (compressor->jobs[i % MAX_COMPRESS_JOBS].entry != index)
+            continue;
+        while (compressor->completed <= i)
+            pthread_cond_wait(&compressor->job_done, &compressor->mutex);
+        break;
+    }
+
+    for (; compressor->collected < compressor->completed; ++compressor->collected) {
+        CompressJob *job = &compressor->jobs[compressor->collected % MAX_COMPRESS_JOBS];
+        UndoEntry *entry = &log->entries[job->entry];
+        // Only keep the compressed pixels if they're actually smaller, moved
+        // to a buffer of their own size
+        if (job->size < job->count*sizeof(Color)) {
+            entry->compressed = pool_alloc(&log->pool, job->size);
+            memcpy(entry->compressed, job->data, job->size);
+            entry->compressed_size = job->size;
+            pool_free_image(&log->pool, &entry->image);
+        }
+        pool_free(&log->pool, job->data, rle_bound(job->count));
+    }
+    pthread_mutex_unlock(&compressor->mutex);
+}
+
+// Queues the CPU pixels of the entry at `index` for compression
+static void undo_log_compress(UndoLog *log, size_t index) {
+    Compressor *compressor = &log->compressor;
+    if (!compressor->running)
+        return;
+
+    // Make room by waiting for the oldest job if the queue is full
+    if (compressor->submitted - compressor->collected == MAX_COMPRESS_JOBS)
+        undo_log_collect(log, compressor->jobs[compressor->collected % MAX_COMPRESS_JOBS].entry);
+
+    const UndoEntry *entry = &log->entries[index];
+    pthread_mutex_lock(&compressor->mutex);
+    compressor->jobs[compressor->submitted % MAX_COMPRESS_JOBS] = (CompressJob){
+        .entry = index,
+        .pixels = entry->image.data,
+        .count = entry->width*entry->height,
+        .data = pool_alloc(&log->pool, rle_bound((size_t)entry->width*entry->height)),
+    };
+    ++compressor->submitted;
+    pthread_cond_signal(&compressor->job_added);
+    pthread_mutex_unlock(&compressor->mutex);
+}
+
+// Makes sure the CPU pixels of entry are uncompressed in `image`
+static void undo_entry_decompress(Pool *pool, UndoEntry *entry) {
+    if (entry->compressed == NULL)
+        return;
+    entry->image = pool_alloc_image(pool, entry->width, entry->height);
+    rle_decode(entry->compressed, entry->compressed_size, entry->image.data, entry->width*entry->height);
+    pool_free(pool, entry->compressed, entry->compressed_size);
+    entry->compressed = NULL;
+    entry->compressed_size = 0;
+}
+
+// Completes the oldest in-flight readback if it has finished, or waits for it
+// to finish if `wait` is set. Returns false if there was nothing to harvest.
+static bool undo_log_harvest(UndoLog *log, bool wait) {
+    if (log->readback_count == 0)
+        return false;
+
+    Readback *readback = &log->readbacks[log->readback_first];
+    const GLenum status = (wait)
+        ? glClientWaitSync(readback->fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX)
+        : glClientWaitSync(readback->fence, 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED)
+        return false;
+    glDeleteSync(readback->fence);
+
+    // Copy the pixels out of the pbo, mapping it will block if the fence
+    // somehow failed so we're correct either way.
+    UndoEntry *entry = &log->entries[readback->entry];
+    const size_t size = (size_t)entry->width*entry->height*sizeof(Color);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+    const void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+    memcpy(entry->image.data, pixels, size);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if (readback->spill) {
+        // The entry now only lives on the CPU
+        UnloadRenderTexture(entry->texture);
+        entry->texture = (RenderTexture2D){0};
+    } else {
+        // Keep the pixels from before the change in the entry, and the new
+        // pixels in the canvas copy.
+        undo_entry_swap(log, entry);
+    }
+    undo_log_compress(log, readback->entry);
+
+    log->readback_first = (log->readback_first + 1) % MAX_READBACKS;
+    --log->readback_count;
+    return true;
+}
+
+// Harvests all readbacks and compression jobs that have finished without
+// blocking
+static inline void undo_log_poll(UndoLog *log) {
+    while (undo_log_harvest(log, false))
+        ;
+    undo_log_collect(log, SIZE_MAX);
+}
+
+// Blocks until all in-flight readbacks are harvested, needed before the
+// entries or canvas copy are touched.
+static inline void undo_log_finish(UndoLog *log) {
+    while (undo_log_harvest(log, true))
+        ;
+}
+
+// Blocks until the entry at `index` is no longer being read back or
+// compressed
+static void undo_log_wait(UndoLog *log, size_t index) {
+    for (size_t i = 0; i < log->readback_count; ++i) {
+        if (log->readbacks[(log->readback_first + i) % MAX_READBACKS].entry != index)
+            continue;
+        // Readbacks complete in order, so harvest everything up to and
+        // including this one.
+        for (size_t j = 0; j <= i; ++j)
+            undo_log_harvest(log, true);
+        break;
+    }
+    undo_log_collect(log, index);
+}
+
+// Starts a GPU->CPU copy of the entry at `index` into a pixel buffer object,
+// harvested by undo_log_poll() a frame or two later. The pixels are read from
+// the entry texture when spilling, otherwise from the canvas.
+static void undo_log_readback(UndoLog *log, size_t index, bool spill) {
+    if (log->readback_count == MAX_READBACKS)
+        undo_log_harvest(log, true);
+
+    const UndoEntry *entry = &log->entries[index];
+    Readback *readback = &log->readbacks[(log->readback_first + log->readback_count) % MAX_READBACKS];
+    const size_t size = (size_t)entry->width*entry->height*sizeof(Color);
+    if (readback->pbo == 0)
+        glGenBuffers(1, &readback->pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+    if (readback->capacity < size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        readback->capacity = size;
+    }
+
+    // With a pack buffer bound the pixels are written to offsets into it
+    if (spill) {
+        rlEnableFramebuffer(entry->texture.id);
+        glReadPixels(0, 0, entry->width, entry->height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        rlDisableFramebuffer();
+    } else {
+        canvas_read_pixels(log->canvas, undo_entry_bounds(entry), NULL);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback->entry = index;
+    readback->spill = spill;
+    ++log->readback_count;
+}
+
+// Frees the pixels of the entry at `index`, waiting for it first if it is
+// in flight
+static void undo_log_unload(UndoLog *log, size_t index) {
+    undo_log_wait(log, index);
+
+    UndoEntry *entry = &log->entries[index];
+    pool_free_image(&log->pool, &entry->image);
+    pool_free(&log->pool, entry->compressed, entry->compressed_size);
+    entry->compressed = NULL;
+    entry->compressed_size = 0;
+    if (entry->texture.id != 0) {
+        UnloadRenderTexture(entry->texture);
+        entry->texture = (RenderTexture2D){0};
+        log->vram_used -= undo_entry_vram(entry);
+    }
+
+    const size_t tile_count = canvas_tile_count(log->canvas);
+    unload_tiles(entry->tiles, tile_count);
+    unload_tiles(entry->committed_tiles, tile_count);
+    free_copy_tiles(&log->pool, entry->copy_tiles, tile_count);
+    entry->tiles = NULL;
+    entry->committed_tiles = NULL;
+    entry->copy_tiles = NULL;
+    entry->clear = false;
+}
+
+// Drops the entries after the selected one, so the next push follows it.
+// Only indices move, the dropped entries are unloaded by
+// undo_log_reclaim() or when their slot is reused.
+static inline void undo_log_truncate(UndoLog *log) {
+    const size_t dropped = (log->top + log->size - log->selected - 1) % log->size;
+    log->top = (log->selected + 1) % log->size;
+    log->used_size -= dropped;
+    log->stale += dropped;
+}
+
+// Unloads at most one stale entry, the newest so the rest stay contiguous
+// from `top`
+static inline void undo_log_reclaim(UndoLog *log) {
+    if (log->stale == 0)
+        return;
+    --log->stale;
+    undo_log_unload(log, (log->top + log->stale) % log->size);
+}
+
+// Moves the oldest GPU-resident entries to the CPU until the entry textures
+// fit in the VRAM budget. The entry at `keep` is about to be used and is
+// left on the GPU.
+static void undo_log_spill(UndoLog *log, size_t keep) {
+    const size_t oldest = (log->top + log->size - log->used_size) % log->size;
+    for (size_t n = 0; n < log->used_size && log->vram_used > log->vram_budget; ++n) {
+        const size_t i = (oldest + n) % log->size;
+        UndoEntry *entry = &log->entries[i];
+        // Skip entries already on the CPU, or on their way there
+        if (i == keep || entry->texture.id == 0 || entry->image.data != NULL)
+            continue;
+        // The texture is unloaded once the readback is harvested, but we
+        // stop counting it right away to not spill more than needed.
+        entry->image = pool_alloc_image(&log->pool, entry->width, entry->height);
+        log->vram_used -= undo_entry_vram(entry);
+        undo_log_readback(log, i, true);
+    }
+}
+
+// Makes room for a new entry at `top` and returns it
+static UndoEntry *undo_log_begin_push(UndoLog *log) {
+    // Entries are pushed in order until the log wraps, so `top` is at most
+    // one past the allocated ones
+    if (log->top == log->capacity) {
+        const size_t capacity = MIN(MAX(2*log->capacity, 16), log->size);
+        log->entries = realloc(log->entries, capacity*sizeof(UndoEntry));
+        memset(&log->entries[log->capacity], 0, (capacity - log->capacity)*sizeof(UndoEntry));
+        log->capacity = capacity;
+    }
+
+    // If we're out of space we know the entry is already occupied
+    // so unload it first.
+    assert(log->used_size <= log->size);
+    assert(log->stale <= log->size - log->used_size);
+    if (log->used_size == log->size) {
+        undo_log_unload(log, log->top);
+    } else if (log->stale > 0) {
+        // The stale entries start at `top`, so they now start one later
+        undo_log_unload(log, log->top);
+        --log->stale;
+    }
+    return &log->entries[log->top];
+}
+
+// Selects the entry at `top` once it has been filled in
+static void undo_log_end_push(UndoLog *log) {
+    // Update indices/used_size
+    log->selected = log->top;
+    log->top = (log->top + 1) % log->size;
+    if (log->used_size < log->size)
+        ++log->used_size;
+
+    // If the log is full the entry at `top` is now the oldest
+    if (log->used_size == log->size)
+        undo_log_unload(log, log->top);
+
+    if (undo_log_on_gpu(log))
+        undo_log_spill(log, log->selected);
+}
+
+// Swaps the entry at `index` with the region of the canvas it covers,
+// undoing the change if it was applied and redoing it if it was undone.
+static void undo_log_apply(UndoLog *log, size_t index) {
+    // The entry contents are about to change, so it can't be in flight
+    undo_log_wait(log, index);
+
+    Canvas *canvas = log->canvas;
+    UndoEntry *entry = &log->entries[index];
+    const Bounds bounds = undo_entry_bounds(entry);
+
+    if (entry->clear) {
+        RenderTexture2D *tiles = canvas->tiles;
+        canvas->tiles = entry->tiles;
+        entry->tiles = tiles;
+        // Mipmaps are tracked per tile position, not per tile
+        for (size_t i = 0; i < canvas_tile_count(canvas); ++i)
+            canvas->stale_mipmaps[i] = canvas->changed[i] = true;
+        if (undo_log_on_gpu(log)) {
+            tiles = log->committed.tiles;
+            log->committed.tiles = entry->committed_tiles;
+            entry->committed_tiles = tiles;
+        } else {
+            Color **copy = log->copy;
+            log->copy = entry->copy_tiles;
+            entry->copy_tiles = copy;
+        }
+    } else if (undo_log_on_gpu(log)) {
+        // Entries that were spilled to the CPU are moved back to the GPU
+        if (entry->texture.id == 0) {
+            undo_entry_decompress(&log->pool, entry);
+            entry->texture = LoadRenderTexture(entry->width, entry->height);
+            UpdateTexture(entry->texture.texture, entry->image.data);
+            pool_free_image(&log->pool, &entry->image);
+            log->vram_used += undo_entry_vram(entry);
+            undo_log_spill(log, index);
+        }
+
+        // GPU->GPU swap, with the committed copy as scratch space since it
+        // holds the same pixels as the canvas outside of strokes.
+        canvas_blit_from(entry->texture, canvas, bounds);
+        canvas_blit_to(&log->committed, bounds, entry->texture);
+        canvas_blit(canvas, &log->committed, bounds);
+    } else {
+        // CPU->GPU copy of the entry, then swap it with the canvas copy
+        undo_entry_decompress(&log->pool, entry);
+        canvas_write_pixels(canvas, bounds, entry->image.data);
+        undo_entry_swap(log, entry);
+        undo_log_compress(log, index);
+    }
+}
+
+// Pushes the region `bounds` of the canvas onto the undo log. On the CPU
+// this queues a GPU->CPU copy, on the GPU the region is copied into a new
+// texture.
+static inline void undo_log_push(UndoLog *log, Bounds bounds) {
+    Canvas *canvas = log->canvas;
+    bounds = bounds_intersect(bounds, canvas_bounds(canvas));
+    if (bounds_is_empty(bounds))
+        return;
+
+    UndoEntry *entry = undo_log_begin_push(log);
+    entry->x = bounds.x0;
+    entry->y = bounds.y0;
+    entry->width = bounds.x1 - bounds.x0;
+    entry->height = bounds.y1 - bounds.y0;
+
+    if (undo_log_on_gpu(log)) {
+        // Keep the pixels from before the change in the entry, and the new
+        // pixels in the committed copy.
+        entry->texture = LoadRenderTexture(entry->width, entry->height);
+        log->vram_used += undo_entry_vram(entry);
+        canvas_blit_to(&log->committed, bounds, entry->texture);
+        canvas_blit(canvas, &log->committed, bounds);
+    } else {
+        // Copy the touched region of the canvas to the log
+        entry->image = pool_alloc_image(&log->pool, entry->width, entry->height);
+        if (log->async) {
+            undo_log_readback(log, log->top, false);
+        } else {
+            canvas_read_pixels(canvas, bounds, entry->image.data);
+            undo_entry_swap(log, entry);
+            undo_log_compress(log, log->top);
+        }
+    }
+
+    undo_log_end_push(log);
+}
+
+// Clears the canvas to the background and pushes the clear onto the undo
+// log. The cleared tiles are moved into the entry, so no pixels are copied.
+static void undo_log_clear(UndoLog *log) {
+    // Readbacks in flight get swapped into the copy, so they need to land
+    // before it is swapped out.
+    undo_log_finish(log);
+
+    const size_t tile_count = canvas_tile_count(log->canvas);
+    UndoEntry *entry = undo_log_begin_push(log);
+    *entry = (UndoEntry){
+        .width = log->canvas->width,
+        .height = log->canvas->height,
+        .clear = true,
+        .tiles = calloc(tile_count, sizeof(RenderTexture2D)),
+    };
+    if (undo_log_on_gpu(log))
+        entry->committed_tiles = calloc(tile_count, sizeof(RenderTexture2D));
+    else
+        entry->copy_tiles = calloc(tile_count, sizeof(Color *));
+
+    // Swap in the empty tiles
+    undo_log_apply(log, log->top);
+    undo_log_end_push(log);
+}
+
+// Moves the selection `offset` entries through the log, returns the area
+// of the canvas that changed
+static inline Bounds undo_log_copy(UndoLog *log, int offset) {
+    undo_log_finish(log);
+
+    Bounds changed = BOUNDS_EMPTY;
+    for (; offset < 0; ++offset) {
+        // Undo the selected entry then select the previous one
+        undo_log_apply(log, log->selected);
+        changed = bounds_union(changed, undo_entry_bounds(&log->entries[log->selected]));
+        log->selected = (log->selected + log->size - 1) % log->size;
+    }
+
+    for (; offset > 0; --offset) {
+        // Select the next entry then redo it
+        log->selected = (log->selected + 1) % log->size;
+        undo_log_apply(log, log->selected);
+        changed = bounds_union(changed, undo_entry_bounds(&log->entries[log->selected]));
+    }
+    return changed;
+}
+
+// Adds the bytes of CPU and GPU memory held by an entry, other than its
+// texture which is counted in `vram_used`
+static void undo_entry_memory(const UndoLog *log, const UndoEntry *entry, size_t *cpu, size_t *gpu) {
+    const size_t tile_count = canvas_tile_count(log->canvas);
+    const size_t tile_size = TILE_SIZE*TILE_SIZE*sizeof(Color);
+    if (entry->image.data != NULL)
+        *cpu += (size_t)entry->width*entry->height*sizeof(Color);
+    *cpu += entry->compressed_size;
+    if (!entry->clear)
+        return;
+    for (size_t j = 0; j < tile_count; ++j) {
+        *gpu += (entry->tiles != NULL && entry->tiles[j].id != 0) ? 2*tile_size : 0;
+        *gpu += (entry->committed_tiles != NULL && entry->committed_tiles[j].id != 0) ? 2*tile_size : 0;
+        *cpu += (entry->copy_tiles != NULL && entry->copy_tiles[j] != NULL) ? tile_size : 0;
+    }
+}
+
+// Bytes of CPU and GPU memory held by the log, including its copy of the
+// canvas. Like undo_entry_vram() tiles count their depth attachment.
+static void undo_log_memory(const UndoLog *log, size_t *cpu, size_t *gpu) {
+    const size_t tile_count = canvas_tile_count(log->canvas);
+    const size_t tile_size = TILE_SIZE*TILE_SIZE*sizeof(Color);
+    *cpu = 0;
+    *gpu = log->vram_used;
+    for (size_t i = 0; i < log->capacity; ++i)
+        undo_entry_memory(log, &log->entries[i], cpu, gpu);
+    for (size_t j = 0; j < tile_count; ++j) {
+        *cpu += (log->copy != NULL && log->copy[j] != NULL) ? tile_size : 0;
+        *gpu += (log->committed.tiles != NULL && log->committed.tiles[j].id != 0) ? 2*tile_size : 0;
+    }
+}
+
+#ifndef BEAK_NO_MAIN
+// Drops the oldest entries until the log holds at most `budget` bytes, as
+// counted by undo_log_memory(). Entries that can be undone to are dropped
+// first: the selected entry always stays, along with the redo entries after
+// it. Returns the bytes still held.
+static size_t undo_log_trim(UndoLog *log, size_t budget) {
+    size_t cpu, gpu;
+    undo_log_memory(log, &cpu, &gpu);
+    size_t used = cpu + gpu;
+    while (used > budget) {
+        const size_t oldest = (log->top + log->size - log->used_size) % log->size;
+        if (oldest == log->selected)
+            break;
+        // The next entry becomes the oldest, which is never undone, so
+        // neither its pixels nor the old oldest entry are needed anymore
+        const size_t next = (oldest + 1) % log->size;
+        size_t freed = log->vram_used;
+        undo_entry_memory(log, &log->entries[oldest], &freed, &freed);
+        undo_entry_memory(log, &log->entries[next], &freed, &freed);
+        undo_log_unload(log, oldest);
+        undo_log_unload(log, next);
+        freed -= log->vram_used;
+        --log->used_size;
+        used -= MIN(freed, used);
+    }
+    return used;
+}
+
+#endif // BEAK_NO_MAIN
+
+// Sets up an empty log for `canvas`, on the GPU if `vram_budget` > 0 and
+// supported. The first entry still has to be pushed with undo_log_clear().
+static void undo_log_init(UndoLog *log, Canvas *canvas, size_t size, size_t vram_budget, size_t pool_limit) {
+    *log = (UndoLog){
+        .canvas = canvas,
+        .size = size,
+        .async = rlGetVersion() == RL_OPENGL_33 || rlGetVersion() == RL_OPENGL_43,
+        .vram_budget = vram_budget,
+        .pool.limit = pool_limit,
+    };
+
+    // Keeping the undo log on the GPU needs framebuffer blits and fences
+    if (log->vram_budget > 0 && !log->async) {
+        fprintf(stderr, "[warning]: --undo-vram-budget needs OpenGL 3.3, keeping undo log on the CPU\n");
+        log->vram_budget = 0;
+    }
+
+    if (log->vram_budget > 0)
+        canvas_init(&log->committed, canvas->width, canvas->height, canvas->background);
+    else
+        log->copy = calloc(canvas_tile_count(canvas), sizeof(Color *));
+
+    compressor_start(&log->compressor);
+}
+
+static void undo_log_free(UndoLog *log) {
+    undo_log_finish(log);
+    for (size_t i = 0; i < MAX_READBACKS; ++i)
+        glDeleteBuffers(1, &log->readbacks[i].pbo);
+    for (size_t i = 0; i < log->capacity; ++i)
+        undo_log_unload(log, i);
+    compressor_stop(&log->compressor);
+    free(log->entries);
+    free_copy_tiles(&log->pool, log->copy, canvas_tile_count(log->canvas));
+    pool_release(&log->pool);
+    if (undo_log_on_gpu(log))
+        canvas_unload(&log->committed);
+    *log = (UndoLog){0};
+}
+
+// Grows `*array` to fit `count` items of `size` bytes
+static void *grow_array(void *array, size_t *capacity, size_t count, size_t size) {
+    if (count <= *capacity)
+        return array;
+    *capacity = MAX(count, 2*(*capacity));
+    return realloc(array, *capacity*size);
+}
+
+#ifndef BEAK_NO_MAIN
+//
+// History: Undo history recording strokes instead of the pixels they
+//          touched, an alternative to UndoLog. Every `keyframe_interval`
+//          strokes the canvas is snapshotted into a keyframe, undoing
+//          restores the closest keyframe before the target state and replays
+//          the strokes from there. Redoing just replays the next stroke.
+//
+// canvas: The canvas strokes are drawn to.
+// brush: Brush strokes are replayed with.
+// points: Samples of all segments, each segment has its own copy of the
+//         sample it continues from.
+// segments: Runs of samples drawn in one go with the same radius and color.
+// strokes: Runs of segments, each undone/redone as a whole.
+// stroke_count: Number of recorded strokes, including ones that were undone.
+// applied: Number of strokes the canvas currently shows.
+// recording: Whether the last stroke is still being drawn.
+// keyframes: Snapshots of the canvas, oldest first. There is always at least
+//            one, and nothing before the first one can be undone.
+// keyframe_interval: Number of strokes between keyframes.
+// keyframe_budget: Bytes of keyframes kept before the oldest are dropped,
+//                  along with the strokes leading up to the next one.
+// keyframe_bytes: Bytes used by keyframes.
+//
+typedef struct HistorySegment {
+    size_t first;
+    size_t count;
+    float radius;
+    Color color;
+} HistorySegment;
+
+// A stroke without segments clears the canvas
+typedef struct HistoryStroke {
+    size_t first;
+    size_t count;
+} HistoryStroke;
+
+// tiles, sizes: Run-length encoded pixels of each canvas tile, NULL for
+//               unallocated ones.
+// stroke: Number of strokes applied to the snapshotted canvas.
+typedef struct Keyframe {
+    unsigned char **tiles;
+    size_t *sizes;
+    size_t bytes;
+    size_t stroke;
+} Keyframe;
+
+typedef struct History {
+    Canvas *canvas;
+    Brush *brush;
+
+    Vector2 *points;
+    size_t point_count, point_capacity;
+    HistorySegment *segments;
+    size_t segment_count, segment_capacity;
+    HistoryStroke *strokes;
+    size_t stroke_count, stroke_capacity;
+    size_t applied;
+    bool recording;
+
+    Keyframe *keyframes;
+    size_t keyframe_count, keyframe_capacity;
+    size_t keyframe_interval;
+    size_t keyframe_budget;
+    size_t keyframe_bytes;
+} History;
+
+static void keyframe_free(Keyframe *keyframe, size_t tile_count) {
+    for (size_t i = 0; i < tile_count; ++i)
+        free(keyframe->tiles[i]);
+    free(keyframe->tiles);
+    free(keyframe->sizes);
+}
+
+static void history_snapshot(History *history) {
+    const Canvas *canvas = history->canvas;
+    const size_t tile_count = canvas_tile_count(canvas);
+    Keyframe keyframe = {
+        .tiles = calloc(tile_count, sizeof(unsigned char *)),
+        .sizes = calloc(tile_count, sizeof(size_t)),
+        .bytes = tile_count*(sizeof(unsigned char *) + sizeof(size_t)),
+        .stroke = history->applied,
+    };
+
+    Color *pixels = malloc(TILE_SIZE*TILE_SIZE*sizeof(Color));
+    unsigned char *data = malloc(rle_bound(TILE_SIZE*TILE_SIZE));
+    for (int ty = 0; ty < canvas->tiles_y; ++ty) {
+        for (int tx = 0; tx < canvas->tiles_x; ++tx) {
+            if (!canvas_has_tile(canvas, tx, ty))
+                continue;
+            const size_t i = ty*canvas->tiles_x + tx;
+            const Bounds part = bounds_intersect(tile_bounds(tx, ty), canvas_bounds(canvas));
+            canvas_read_pixels(canvas, part, pixels);
+            keyframe.sizes[i] = rle_encode(pixels, (size_t)(part.x1 - part.x0)*(part.y1 - part.y0), data);
+            keyframe.tiles[i] = malloc(keyframe.sizes[i]);
+            memcpy(keyframe.tiles[i], data, keyframe.sizes[i]);
+            keyframe.bytes += keyframe.sizes[i];
+        }
+    }
+    free(data);
+    free(pixels);
+
+    history->keyframes = grow_array(history->keyframes, &history->keyframe_capacity,
+                                    history->keyframe_count + 1, sizeof(Keyframe));
+    history->keyframes[history->keyframe_count++] = keyframe;
+    history->keyframe_bytes += keyframe.bytes;
+
+    // Drop the oldest keyframes and everything only they could get back to
+    size_t dropped = 0;
+    while (history->keyframe_bytes > history->keyframe_budget && history->keyframe_count - dropped > 1) {
+        history->keyframe_bytes -= history->keyframes[dropped].bytes;
+        keyframe_free(&history->keyframes[dropped], tile_count);
+        ++dropped;
+    }
+    if (dropped == 0)
+        return;
+
+    history->keyframe_count -= dropped;
+    memmove(history->keyframes, history->keyframes + dropped, history->keyframe_count*sizeof(Keyframe));
+
+    const size_t strokes = history->keyframes[0].stroke;
+    const size_t segments = strokes < history->stroke_count ? history->strokes[strokes].first : history->segment_count;
+    const size_t points = segments < history->segment_count ? history->segments[segments].first : history->point_count;
+    history->stroke_count -= strokes;
+    history->segment_count -= segments;
+    history->point_count -= points;
+    history->applied -= strokes;
+    memmove(history->strokes, history->strokes + strokes, history->stroke_count*sizeof(HistoryStroke));
+    memmove(history->segments, history->segments + segments, history->segment_count*sizeof(HistorySegment));
+    memmove(history->points, history->points + points, history->point_count*sizeof(Vector2));
+    for (size_t i = 0; i < history->stroke_count; ++i)
+        history->strokes[i].first -= segments;
+    for (size_t i = 0; i < history->segment_count; ++i)
+        history->segments[i].first -= points;
+    for (size_t i = 0; i < history->keyframe_count; ++i)
+        history->keyframes[i].stroke -= strokes;
+}
+
+// Starts the history from the current canvas
+static void history_init(History *history, Canvas *canvas, Brush *brush, size_t keyframe_interval, size_t keyframe_budget) {
+    *history = (History){
+        .canvas = canvas,
+        .brush = brush,
+        .keyframe_interval = keyframe_interval,
+        .keyframe_budget = keyframe_budget,
+    };
+    history_snapshot(history);
+}
+
+static void history_unload(History *history) {
+    const size_t tile_count = canvas_tile_count(history->canvas);
+    for (size_t i = 0; i < history->keyframe_count; ++i)
+        keyframe_free(&history->keyframes[i], tile_count);
+    free(history->keyframes);
+    free(history->strokes);
+    free(history->segments);
+    free(history->points);
+}
+
+// Starts a new stroke, forgetting the strokes that could be redone
+static void history_begin_stroke(History *history) {
+    history->stroke_count = history->applied;
+    if (history->applied == 0) {
+        history->segment_count = 0;
+    } else {
+        const HistoryStroke *last = &history->strokes[history->applied - 1];
+        history->segment_count = last->first + last->count;
+    }
+    history->point_count = history->segment_count == 0 ? 0 :
+        history->segments[history->segment_count - 1].first + history->segments[history->segment_count - 1].count;
+
+    const size_t tile_count = canvas_tile_count(history->canvas);
+    while (history->keyframe_count > 1 && history->keyframes[history->keyframe_count - 1].stroke > history->applied) {
+        Keyframe *keyframe = &history->keyframes[--history->keyframe_count];
+        history->keyframe_bytes -= keyframe->bytes;
+        keyframe_free(keyframe, tile_count);
+    }
+
+    history->strokes = grow_array(history->strokes, &history->stroke_capacity,
+                                  history->stroke_count + 1, sizeof(HistoryStroke));
+    history->strokes[history->stroke_count++] = (HistoryStroke){.first = history->segment_count};
+    ++history->applied;
+    history->recording = true;
+}
+
+// Records samples drawn in one go, starting a new stroke if needed
+static void history_add_segment(History *history, const Vector2 *points, size_t count, float radius, Color color) {
+    if (!history->recording)
+        history_begin_stroke(history);
+
+    history->points = grow_array(history->points, &history->point_capacity,
+                                 history->point_count + count, sizeof(Vector2));
+    memcpy(history->points + history->point_count, points, count*sizeof(Vector2));
+
+    history->segments = grow_array(history->segments, &history->segment_capacity,
+                                   history->segment_count + 1, sizeof(HistorySegment));
+    history->segments[history->segment_count++] = (HistorySegment){history->point_count, count, radius, color};
+    history->point_count += count;
+    ++history->strokes[history->stroke_count - 1].count;
+}
+
+static void history_end_stroke(History *history) {
+    if (!history->recording)
+        return;
+    history->recording = false;
+    if (history->applied - history->keyframes[history->keyframe_count - 1].stroke >= history->keyframe_interval)
+        history_snapshot(history);
+}
+
+// Unloads every canvas tile with pixels and marks it changed and its mipmap
+// stale, returns the area that changed
+static Bounds history_clear_canvas(History *history) {
+    Canvas *canvas = history->canvas;
+    Bounds changed = BOUNDS_EMPTY;
+    for (int ty = 0; ty < canvas->tiles_y; ++ty) {
+        for (int tx = 0; tx < canvas->tiles_x; ++tx) {
+            const size_t i = ty*canvas->tiles_x + tx;
+            RenderTexture2D *tile = &canvas->tiles[i];
+            if (tile->id == 0)
+                continue;
+            UnloadRenderTexture(*tile);
+            *tile = (RenderTexture2D){0};
+            canvas->stale_mipmaps[i] = canvas->changed[i] = true;
+            changed = bounds_union(changed, bounds_intersect(tile_bounds(tx, ty), canvas_bounds(canvas)));
+        }
+    }
+    return changed;
+}
+
+// Clears the canvas as a stroke of its own, which is always followed by a
+// keyframe since the blank canvas costs next to nothing to store
+static Bounds history_clear(History *history) {
+    history_begin_stroke(history);
+    history->recording = false;
+    const Bounds changed = history_clear_canvas(history);
+    history_snapshot(history);
+    return changed;
+}
+
+static Bounds history_replay(History *history, size_t stroke) {
+    const HistoryStroke *s = &history->strokes[stroke];
+    if (s->count == 0)
+        return history_clear_canvas(history);
+
+    Bounds changed = BOUNDS_EMPTY;
+    for (size_t i = s->first; i < s->first + s->count; ++i) {
+        const HistorySegment *segment = &history->segments[i];
+        const Bounds drawn = canvas_draw_stroke(history->canvas, history->brush, &history->points[segment->first],
+                                                segment->count, segment->radius, segment->color);
+        changed = bounds_union(changed, drawn);
+    }
+    return changed;
+}
+
+static inline bool history_can_undo(const History *history) {
+    return history->applied > history->keyframes[0].stroke;
+}
+
+static inline bool history_can_redo(const History *history) {
+    return history->applied < history->stroke_count;
+}
+
+// Undoes the last applied stroke, returns the area of the canvas that changed
+static Bounds history_undo(History *history) {
+    history_end_stroke(history);
+    const size_t target = history->applied - 1;
+    size_t k = history->keyframe_count - 1;
+    while (history->keyframes[k].stroke > target)
+        --k;
+    const Keyframe *keyframe = &history->keyframes[k];
+
+    // Restore the keyframe, tiles it doesn't have are blank
+    Canvas *canvas = history->canvas;
+    Bounds changed = BOUNDS_EMPTY;
+    Color *pixels = malloc(TILE_SIZE*TILE_SIZE*sizeof(Color));
+    for (int ty = 0; ty < canvas->tiles_y; ++ty) {
+        for (int tx = 0; tx < canvas->tiles_x; ++tx) {
+            const size_t i = ty*canvas->tiles_x + tx;
+            const Bounds part = bounds_intersect(tile_bounds(tx, ty), canvas_bounds(canvas));
+            if (keyframe->tiles[i] != NULL) {
+                rle_decode(keyframe->tiles[i], keyframe->sizes[i], pixels, (size_t)(part.x1 - part.x0)*(part.y1 - part.y0));
+                canvas_write_pixels(canvas, part, pixels);
+                changed = bounds_union(changed, part);
+            } else if (canvas->tiles[i].id != 0) {
+                UnloadRenderTexture(canvas->tiles[i]);
+                canvas->tiles[i] = (RenderTexture2D){0};
+                canvas->stale_mipmaps[i] = canvas->changed[i] = true;
+                changed = bounds_union(changed, part);
+            }
+        }
+    }
+    free(pixels);
+
+    for (size_t i = keyframe->stroke; i < target; ++i)
+        changed = bounds_union(changed, history_replay(history, i));
+    history->applied = target;
+    return changed;
+}
+
+// Redoes the next stroke, returns the area of the canvas that changed
+static Bounds history_redo(History *history) {
+    history_end_stroke(history);
+    return history_replay(history, history->applied++);
+}
+
+// Bytes of CPU memory held by the history
+static inline size_t history_memory(const History *history) {
+    return history->keyframe_bytes +
+           history->point_capacity*sizeof(Vector2) +
+           history->segment_capacity*sizeof(HistorySegment) +
+           history->stroke_capacity*sizeof(HistoryStroke);
+}
+
+#endif // BEAK_NO_MAIN
+
+//
+// Palette: Brush colors, computed once at startup so picking one is a table
+//          lookup. Keys 1-9 and 0 pick the first ten, [ and ] step through
+//          all of them.
+//
+// count: Number of colors used.
+// colors: Color per index, alpha is never 0 as that erases.
+//
+typedef struct Palette {
+    uint32_t count;
+    Color colors[MAX_COLORS];
+} Palette;
+
+// Fills the palette with `count` colors linearly spaced in hue
+static void palette_generate(Palette *palette, uint32_t count) {
+    memset(palette, 0, sizeof(*palette));
+    palette->count = count;
+    for (uint32_t i = 0; i < count; ++i)
+        palette->colors[i] = ColorFromHSV(360.0f*((float)i/(float)count), 0.75f, 0.75f);
+}
+
+#ifndef BEAK_NO_MAIN
+// Loads the palette given to --palette, either a number of colors to
+// generate or a file with one 0xRRGGBB or 0xRRGGBBAA color per line
+static bool palette_load(Palette *palette, const char *spec) {
+    char *end;
+    const unsigned long count = strtoul(spec, &end, 10);
+    if (end != spec && *end == '\0') {
+        if (count < 1 || count > MAX_COLORS) {
+            fprintf(stderr, "[error]: --palette must have between 1 and %d colors\n", MAX_COLORS);
+            return false;
+        }
+        palette_generate(palette, count);
+        return true;
+    }
+
+    FILE *file = fopen(spec, "r");
+    if (file == NULL) {
+        fprintf(stderr, "[error]: Failed to open palette '%s'\n", spec);
+        return false;
+    }
+    memset(palette, 0, sizeof(*palette));
+    char line[64];
+    size_t line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        ++line_number;
+        const char *hex = line;
+        while (isspace((unsigned char)*hex))
+            ++hex;
+        if (*hex == '\0')
+            continue;
+        if (hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X'))
+            hex += 2;
+        const unsigned long value = strtoul(hex, &end, 16);
+        const ptrdiff_t digits = end - hex;
+        while (isspace((unsigned char)*end))
+            ++end;
+        const Color color = (digits == 6) ? GetColor((value << 8) | 0xff) : GetColor(value);
+        if ((digits != 6 && digits != 8) || *end != '\0' || color.a == 0) {
+            fprintf(stderr, "[error]: %s:%zu: Invalid palette color\n", spec, line_number);
+            fclose(file);
+            return false;
+        }
+        if (palette->count == MAX_COLORS) {
+            fprintf(stderr, "[error]: %s:%zu: Palettes have at most %d colors\n", spec, line_number, MAX_COLORS);
+            fclose(file);
+            return false;
+        }
+        palette->colors[palette->count++] = color;
+    }
+    fclose(file);
+    if (palette->count == 0) {
+        fprintf(stderr, "[error]: Palette '%s' has no colors\n", spec);
+        return false;
+    }
+    return true;
+}
+
+#endif // BEAK_NO_MAIN
+
+// Palettes read from projects and hosts
+static inline bool palette_valid(const Palette *palette) {
+    return palette->count >= 1 && palette->count <= MAX_COLORS;
+}
+
+#ifndef BEAK_NO_MAIN
+//
+// Shared canvas sessions. One beak hosts with --host and others join it
+// with --join. Peers send what they draw as stroke events, polylines of
+// fixed-point samples with a palette index, batched into one write per
+// frame. Everything else that changes pixels, undo/redo and fills, is sent
+// as run-length encoded regions, and so is a snapshot of the canvas when
+// someone joins. The host applies what it receives and relays what it
+// accepted to the other peers. Multi-byte fields are little-endian on the
+// wire, so hosts of either byte order can share a session.
+//
+
+#define NET_MAGIC "beaknet2"
+
+// Most peers joined to a host at once
+#define MAX_PEERS 15
+
+// Stroke samples are sent in 1/NET_POINT_SCALE pixels
+#define NET_POINT_SCALE 16.0f
+
+// Largest message accepted. Regions are sent a tile at a time, so real ones
+// are far smaller.
+#define NET_MAX_MESSAGE (1 << 20)
+
+// Erasing is sent as this color index
+#define NET_ERASE 0xff
+
+typedef enum NetMessageType {
+    NET_HELLO,
+    NET_STROKE,
+    NET_REGION,
+    NET_CLEAR,
+    NET_COMMIT,
+} NetMessageType;
+
+// Converts between host and wire byte order, both ways
+static inline uint16_t net_u16(uint16_t x) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap16(x);
+#else
+    return x;
+#endif
+}
+
+static inline uint32_t net_u32(uint32_t x) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(x);
+#else
+    return x;
+#endif
+}
+
+static inline float net_f32(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bits = net_u32(bits);
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+// Converts the run headers of RLE data between host and wire byte order
+static void net_rle_order(unsigned char *data, size_t size) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    const unsigned char *end = data + size;
+    while (end - data >= (ptrdiff_t)sizeof(uint16_t)) {
+        uint16_t header;
+        memcpy(&header, data, sizeof(header));
+        const uint16_t host = net_u16(header);
+        memcpy(data, &host, sizeof(host));
+        data += sizeof(header);
+        const size_t length = (host & RLE_RUN_BIT) ? 1 : (host & RLE_MAX_LENGTH);
+        data += MIN(length*sizeof(Color), (size_t)(end - data));
+    }
+#else
+    (void)data;
+    (void)size;
+#endif
+}
+
+//
+// NetHeader: Starts every message.
+//
+// size: Bytes of payload that follow.
+// type: A NetMessageType.
+// peer: Who the change is from, filled in by the host when relaying.
+// layer: Layer the change is on.
+//
+typedef struct NetHeader {
+    uint32_t size;
+    uint8_t type;
+    uint8_t peer;
+    uint8_t layer;
+    uint8_t pad;
+} NetHeader;
+
+// Sent by the host to a peer that just connected, before the snapshot
+typedef struct NetHello {
+    char magic[8];
+    uint32_t width, height;
+    uint32_t layer_count;
+    Color background;
+    Palette palette;
+    uint8_t peer;
+    uint8_t pad[3];
+} NetHello;
+
+// Followed by `count - 1` int16_t x, y deltas from the previous sample
+typedef struct NetStroke {
+    float radius;
+    uint8_t color;
+    uint8_t pad[3];
+    int32_t x, y;
+    uint32_t count;
+} NetStroke;
+
+// Followed by the region's pixels, run-length encoded
+typedef struct NetRegion {
+    int32_t x0, y0, x1, y1;
+} NetRegion;
+
+//
+// NetPeer: A connection, to the host when joined or to a peer when hosting.
+//
+// fd: Non-blocking socket, -1 if the slot is free.
+// in, in_size, in_capacity: Bytes received but not parsed yet.
+// out, out_size, out_capacity: Bytes not sent yet.
+//
+typedef struct NetPeer {
+    int fd;
+    unsigned char *in;
+    size_t in_size, in_capacity;
+    unsigned char *out;
+    size_t out_size, out_capacity;
+} NetPeer;
+
+//
+// Net: State of a shared session.
+//
+// listen_fd: Socket accepting peers when hosting, -1 otherwise.
+// peers: Connected peers when hosting, the host in peers[0] when joined.
+// id: Our peer id, the host is 0 and peers are 1 + their slot on the host.
+// pending, pending_layer: Per peer id, the region its changes touched
+//                         since its last commit, and the layer of them.
+// palette: Palette stroke color indices refer to.
+// batch, batch_size, batch_capacity: Messages queued this frame.
+// points, point_capacity: Decoded samples of a received stroke.
+//
+typedef struct Net {
+    int listen_fd;
+    NetPeer peers[MAX_PEERS];
+    uint8_t id;
+    Bounds pending[MAX_PEERS + 1];
+    int pending_layer[MAX_PEERS + 1];
+    Palette palette;
+    unsigned char *batch;
+    size_t batch_size, batch_capacity;
+    Vector2 *points;
+    size_t point_capacity;
+} Net;
+
+static inline bool net_active(const Net *net) {
+    return net->listen_fd >= 0 || net->peers[0].fd >= 0;
+}
+
+static void net_init(Net *net) {
+    *net = (Net){.listen_fd = -1};
+    for (int i = 0; i < MAX_PEERS; ++i)
+        net->peers[i].fd = -1;
+    for (int i = 0; i <= MAX_PEERS; ++i)
+        net->pending[i] = BOUNDS_EMPTY;
+}
+
+static void net_append(unsigned char **buffer, size_t *size, size_t *capacity, const void *data, size_t count) {
+    *buffer = grow_array(*buffer, capacity, *size + count, 1);
+    memcpy(*buffer + *size, data, count);
+    *size += count;
+}
+
+// Appends a message to `buffer`, with the payload already in wire byte
+// order
+static void net_message(unsigned char **buffer, size_t *size, size_t *capacity, NetHeader header,
+                        const void *payload, size_t payload_size, const void *data, size_t data_size) {
+    header.size = net_u32(payload_size + data_size);
+    net_append(buffer, size, capacity, &header, sizeof(header));
+    net_append(buffer, size, capacity, payload, payload_size);
+    net_append(buffer, size, capacity, data, data_size);
+}
+
+static inline void net_queue(Net *net, NetHeader header, const void *payload, size_t payload_size,
+                             const void *data, size_t data_size) {
+    if (!net_active(net))
+        return;
+    header.peer = net->id;
+    net_message(&net->batch, &net->batch_size, &net->batch_capacity, header, payload, payload_size, data, data_size);
+}
+
+static void net_set_socket_options(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    // Strokes are small and latency matters more than packet count
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void net_close_peer(NetPeer *peer) {
+    if (peer->fd >= 0)
+        close(peer->fd);
+    free(peer->in);
+    free(peer->out);
+    *peer = (NetPeer){.fd = -1};
+}
+
+static void net_queue_stroke(Net *net, int layer, NetStroke stroke, const int16_t *deltas) {
+    int16_t wire[2*64];
+    for (uint32_t i = 0; i < 2*(stroke.count - 1); ++i)
+        wire[i] = net_u16(deltas[i]);
+    const uint32_t count = stroke.count;
+    stroke.radius = net_f32(stroke.radius);
+    stroke.x = net_u32(stroke.x);
+    stroke.y = net_u32(stroke.y);
+    stroke.count = net_u32(stroke.count);
+    net_queue(net, (NetHeader){.type = NET_STROKE, .layer = layer}, &stroke, sizeof(stroke),
+              wire, 2*(count - 1)*sizeof(int16_t));
+}
+
+// Queues a polyline drawn on `layer`, split into messages of at most 65
+// samples
+static void net_send_stroke(Net *net, int layer, const Vector2 *points, size_t count, float radius, Color color) {
+    if (!net_active(net) || count == 0)
+        return;
+    uint8_t index = NET_ERASE;
+    for (uint32_t i = 0; i < net->palette.count; ++i)
+        if (color_equal(color, net->palette.colors[i]))
+            index = i;
+
+    int16_t deltas[2*64];
+    NetStroke stroke = {
+        .radius = radius,
+        .color = index,
+        .x = roundf(points[0].x*NET_POINT_SCALE),
+        .y = roundf(points[0].y*NET_POINT_SCALE),
+        .count = 1,
+    };
+    int32_t x = stroke.x, y = stroke.y;
+    for (size_t i = 1; i < count; ++i) {
+        const int32_t to_x = roundf(points[i].x*NET_POINT_SCALE);
+        const int32_t to_y = roundf(points[i].y*NET_POINT_SCALE);
+        // Jumps too long for a delta, zoomed far out, are split into
+        // steps along the segment, which draw the same capsule
+        const int32_t from_x = x, from_y = y;
+        const int32_t steps = MAX(abs(to_x - from_x), abs(to_y - from_y))/INT16_MAX + 1;
+        for (int32_t step = 1; step <= steps; ++step) {
+            if (stroke.count == ARRLEN(deltas)/2 + 1) {
+                net_queue_stroke(net, layer, stroke, deltas);
+                // The next message continues from the last sample of this one
+                stroke.x = x;
+                stroke.y = y;
+                stroke.count = 1;
+            }
+            const int32_t step_x = from_x + (int64_t)(to_x - from_x)*step/steps;
+            const int32_t step_y = from_y + (int64_t)(to_y - from_y)*step/steps;
+            deltas[2*(stroke.count - 1)] = step_x - x;
+            deltas[2*(stroke.count - 1) + 1] = step_y - y;
+            ++stroke.count;
+            x = step_x;
+            y = step_y;
+        }
+    }
+    net_queue_stroke(net, layer, stroke, deltas);
+}
+
+// Appends the pixels of `bounds` on `canvas` to `buffer`, a tile at a time
+static void net_region_messages(unsigned char **buffer, size_t *size, size_t *capacity, NetHeader header,
+                                const Canvas *canvas, Bounds bounds) {
+    bounds = bounds_intersect(bounds, canvas_bounds(canvas));
+    if (bounds_is_empty(bounds))
+        return;
+    Color *pixels = malloc(TILE_SIZE*TILE_SIZE*sizeof(Color));
+    unsigned char *data = malloc(rle_bound(TILE_SIZE*TILE_SIZE));
+    header.type = NET_REGION;
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            const Bounds part = bounds_intersect(bounds, tile_bounds(tx, ty));
+            const size_t count = (size_t)(part.x1 - part.x0)*(part.y1 - part.y0);
+            canvas_read_pixels(canvas, part, pixels);
+            const NetRegion region = {net_u32(part.x0), net_u32(part.y0), net_u32(part.x1), net_u32(part.y1)};
+            const size_t data_size = rle_encode(pixels, count, data);
+            net_rle_order(data, data_size);
+            net_message(buffer, size, capacity, header, &region, sizeof(region), data, data_size);
+        }
+    }
+    free(data);
+    free(pixels);
+}
+
+// Queues the pixels of `bounds` on `layer` and commits them, for changes
+// that aren't strokes
+static void net_send_region(Net *net, const Layers *layers, int layer, Bounds bounds) {
+    if (!net_active(net) || bounds_is_empty(bounds))
+        return;
+    const NetHeader header = {.peer = net->id, .layer = layer};
+    net_region_messages(&net->batch, &net->batch_size, &net->batch_capacity, header, &layers->canvases[layer], bounds);
+    net_queue(net, (NetHeader){.type = NET_COMMIT, .layer = layer}, NULL, 0, NULL, 0);
+}
+
+// Queues pushing the current stroke to everyone's undo logs
+static inline void net_send_commit(Net *net, int layer) {
+    net_queue(net, (NetHeader){.type = NET_COMMIT, .layer = layer}, NULL, 0, NULL, 0);
+}
+
+static inline void net_send_clear(Net *net, int layer) {
+    net_queue(net, (NetHeader){.type = NET_CLEAR, .layer = layer}, NULL, 0, NULL, 0);
+}
+
+// Blocking read of exactly `size` bytes, only used while joining
+static bool net_read_all(int fd, void *data, size_t size) {
+    for (size_t done = 0; done < size;) {
+        const ssize_t n = read(fd, (char *)data + done, size - done);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// Listens on `port` of every address, returns the socket or -1. A dual
+// stack IPv6 socket takes IPv4 peers too, without IPv6 or when it can't be
+// made dual stack this falls back to IPv4 only.
+static int net_listen(uint16_t port) {
+    const int one = 1, zero = 0;
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        const struct sockaddr_in6 address = {
+            .sin6_family = AF_INET6,
+            .sin6_port = htons(port),
+            .sin6_addr = IN6ADDR_ANY_INIT,
+        };
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero)) == 0 &&
+            bind(fd, (const struct sockaddr *)&address, sizeof(address)) == 0 && listen(fd, 4) == 0)
+            return fd;
+        close(fd);
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    const struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(fd, (const struct sockaddr *)&address, sizeof(address)) == 0 && listen(fd, 4) == 0)
+        return fd;
+    close(fd);
+    return -1;
+}
+
+// Starts accepting peers on `port`
+static bool net_host(Net *net, const char *port, const Palette *palette) {
+    net_init(net);
+    net->palette = *palette;
+    net->listen_fd = net_listen(strtoul(port, NULL, 10));
+    if (net->listen_fd < 0) {
+        fprintf(stderr, "[error]: Failed to host on port %s\n", port);
+        return false;
+    }
+    fcntl(net->listen_fd, F_SETFL, fcntl(net->listen_fd, F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+// Connects to a host at "host:port" and fills `hello` with its canvas
+static bool net_join(Net *net, const char *address, NetHello *hello) {
+    net_init(net);
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL || colon - address >= (ptrdiff_t)sizeof(host)) {
+        fprintf(stderr, "[error]: --join expects host:port, got '%s'\n", address);
+        return false;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *addresses;
+    if (getaddrinfo(host, colon + 1, &hints, &addresses) != 0) {
+        fprintf(stderr, "[error]: Failed to resolve '%s'\n", host);
+        return false;
+    }
+    int fd = -1;
+    for (struct addrinfo *a = addresses; a != NULL && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        fprintf(stderr, "[error]: Failed to connect to '%s'\n", address);
+        return false;
+    }
+
+    NetHeader header;
+    const bool read = net_read_all(fd, &header, sizeof(header)) && header.type == NET_HELLO &&
+                      net_u32(header.size) == sizeof(*hello) && net_read_all(fd, hello, sizeof(*hello));
+    if (read) {
+        hello->width = net_u32(hello->width);
+        hello->height = net_u32(hello->height);
+        hello->layer_count = net_u32(hello->layer_count);
+        hello->palette.count = net_u32(hello->palette.count);
+    }
+    if (!read || memcmp(hello->magic, NET_MAGIC, sizeof(hello->magic)) != 0 ||
+        hello->layer_count < 1 || hello->layer_count > MAX_LAYERS || !palette_valid(&hello->palette)) {
+        fprintf(stderr, "[error]: '%s' is not a beak host\n", address);
+        close(fd);
+        return false;
+    }
+    net_set_socket_options(fd);
+    net->peers[0].fd = fd;
+    net->id = hello->peer;
+    net->palette = hello->palette;
+    return true;
+}
+
+// Greets a new peer with the canvas, sending every painted tile. Each layer
+// is committed at once, like a recovered journal.
+static void net_welcome(Net *net, NetPeer *peer, uint8_t id, const Layers *layers) {
+    const Canvas *bottom = &layers->canvases[0];
+    NetHello hello = {
+        .width = net_u32(bottom->width),
+        .height = net_u32(bottom->height),
+        .layer_count = net_u32(layers->count),
+        .background = bottom->background,
+        .peer = id,
+    };
+    memcpy(hello.magic, NET_MAGIC, sizeof(hello.magic));
+    hello.palette = net->palette;
+    hello.palette.count = net_u32(hello.palette.count);
+    net_message(&peer->out, &peer->out_size, &peer->out_capacity, (NetHeader){.type = NET_HELLO},
+                &hello, sizeof(hello), NULL, 0);
+
+    for (int layer = 0; layer < layers->count; ++layer) {
+        const Canvas *canvas = &layers->canvases[layer];
+        const NetHeader header = {.peer = net->id, .layer = layer};
+        for (int ty = 0; ty < canvas->tiles_y; ++ty)
+            for (int tx = 0; tx < canvas->tiles_x; ++tx)
+                if (canvas_has_tile(canvas, tx, ty))
+                    net_region_messages(&peer->out, &peer->out_size, &peer->out_capacity, header,
+                                        canvas, tile_bounds(tx, ty));
+        net_message(&peer->out, &peer->out_size, &peer->out_capacity,
+                    (NetHeader){.type = NET_COMMIT, .peer = net->id, .layer = layer}, NULL, 0, NULL, 0);
+    }
+}
+
+// Pushes what a peer changed since its last commit to the undo log
+static void net_commit(Net *net, int peer, UndoLog *logs) {
+    if (!bounds_is_empty(net->pending[peer]))
+        undo_log_push(&logs[net->pending_layer[peer]], net->pending[peer]);
+    net->pending[peer] = BOUNDS_EMPTY;
+}
+
+// Changes on another layer than the peer's pending ones go to a new entry
+static void net_begin_change(Net *net, NetHeader header, UndoLog *logs) {
+    if (net->pending_layer[header.peer] != header.layer)
+        net_commit(net, header.peer, logs);
+    net->pending_layer[header.peer] = header.layer;
+}
+
+// Applies a received message, adding the region of the canvas it changed to
+// `changed`. Returns false for messages that are malformed or not meant for
+// the session, which aren't applied.
+static bool net_apply(Net *net, NetHeader header, const unsigned char *payload,
+                      Layers *layers, UndoLog *logs, Brush *brush, Bounds *changed) {
+    if (header.layer >= layers->count || header.peer > MAX_PEERS)
+        return false;
+    Canvas *canvas = &layers->canvases[header.layer];
+
+    switch (header.type) {
+    case NET_STROKE: {
+        NetStroke stroke;
+        if (header.size < sizeof(stroke))
+            return false;
+        memcpy(&stroke, payload, sizeof(stroke));
+        stroke.radius = net_f32(stroke.radius);
+        stroke.x = net_u32(stroke.x);
+        stroke.y = net_u32(stroke.y);
+        stroke.count = net_u32(stroke.count);
+        if (stroke.count == 0 || stroke.count > NET_MAX_MESSAGE ||
+            header.size != sizeof(stroke) + 2*(stroke.count - 1)*sizeof(int16_t) || !isfinite(stroke.radius))
+            return false;
+        net_begin_change(net, header, logs);
+        net->points = grow_array(net->points, &net->point_capacity, stroke.count, sizeof(Vector2));
+        int32_t x = stroke.x, y = stroke.y;
+        for (uint32_t i = 0; i < stroke.count; ++i) {
+            if (i > 0) {
+                int16_t delta[2];
+                memcpy(delta, payload + sizeof(stroke) + 2*(i - 1)*sizeof(int16_t), sizeof(delta));
+                x += (int16_t)net_u16(delta[0]);
+                y += (int16_t)net_u16(delta[1]);
+            }
+            net->points[i] = (Vector2){x/NET_POINT_SCALE, y/NET_POINT_SCALE};
+        }
+        const Color color = (stroke.color < net->palette.count) ? net->palette.colors[stroke.color] :
+                            (header.layer == 0) ? canvas->background : BLANK;
+        const Bounds drawn = canvas_draw_stroke(canvas, brush, net->points, stroke.count,
+                                                CLAMP(0.25f, stroke.radius, 1024.0f), color);
+        net->pending[header.peer] = bounds_union(net->pending[header.peer], drawn);
+        *changed = bounds_union(*changed, drawn);
+        return true;
+    }
+    case NET_REGION: {
+        NetRegion region;
+        if (header.size < sizeof(region))
+            return false;
+        memcpy(&region, payload, sizeof(region));
+        region = (NetRegion){net_u32(region.x0), net_u32(region.y0), net_u32(region.x1), net_u32(region.y1)};
+        const Bounds bounds = {region.x0, region.y0, region.x1, region.y1};
+        // Peers send a tile at a time
+        if (bounds_is_empty(bounds) || region.x1 - region.x0 > TILE_SIZE || region.y1 - region.y0 > TILE_SIZE ||
+            region.x0 < 0 || region.y0 < 0 || region.x1 > canvas->width || region.y1 > canvas->height)
+            return false;
+        const size_t count = (size_t)(region.x1 - region.x0)*(region.y1 - region.y0);
+        const size_t data_size = header.size - sizeof(region);
+        unsigned char *data = malloc(data_size);
+        memcpy(data, payload + sizeof(region), data_size);
+        net_rle_order(data, data_size);
+        Color *pixels = malloc(count*sizeof(Color));
+        const bool complete = rle_decode(data, data_size, pixels, count) == count;
+        if (complete) {
+            net_begin_change(net, header, logs);
+            canvas_write_pixels(canvas, bounds, pixels);
+            net->pending[header.peer] = bounds_union(net->pending[header.peer], bounds);
+            *changed = bounds_union(*changed, bounds);
+        }
+        free(pixels);
+        free(data);
+        return complete;
+    }
+    case NET_CLEAR:
+        if (header.size != 0)
+            return false;
+        // What anyone drew on the layer so far is history once its log is
+        // cleared, and so is the rest of what the clearing peer drew
+        for (int i = 0; i <= MAX_PEERS; ++i)
+            if (i == header.peer || net->pending_layer[i] == header.layer)
+                net_commit(net, i, logs);
+        undo_log_clear(&logs[header.layer]);
+        *changed = bounds_union(*changed, canvas_bounds(canvas));
+        return true;
+    case NET_COMMIT:
+        if (header.size != 0)
+            return false;
+        net_commit(net, header.peer, logs);
+        return true;
+    default:
+        // Hellos are only sent by the host, when joining
+        return false;
+    }
+}
+
+// Reads from a peer and applies every complete message. When hosting,
+// messages are also relayed to everyone else. Returns false once the peer
+// is gone.
+static bool net_receive(Net *net, int slot, Layers *layers, UndoLog *logs, Brush *brush, Bounds *changed) {
+    NetPeer *peer = &net->peers[slot];
+    for (;;) {
+        unsigned char data[16384];
+        const ssize_t n = read(peer->fd, data, sizeof(data));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            return false;
+        if (n < 0)
+            break;
+        net_append(&peer->in, &peer->in_size, &peer->in_capacity, data, n);
+    }
+
+    size_t offset = 0;
+    while (peer->in_size - offset >= sizeof(NetHeader)) {
+        NetHeader header;
+        memcpy(&header, peer->in + offset, sizeof(header));
+        header.size = net_u32(header.size);
+        if (header.size > NET_MAX_MESSAGE)
+            return false;
+        if (peer->in_size - offset < sizeof(header) + header.size)
+            break;
+
+        // Peers can only speak for themselves, and only what was applied
+        // here is passed on
+        const unsigned char *payload = peer->in + offset + sizeof(header);
+        if (net->listen_fd >= 0)
+            header.peer = slot + 1;
+        const bool accepted = net_apply(net, header, payload, layers, logs, brush, changed);
+        if (!accepted)
+            fprintf(stderr, "[warning]: Ignored a malformed message from peer %d\n", header.peer);
+        if (accepted && net->listen_fd >= 0) {
+            for (int i = 0; i < MAX_PEERS; ++i) {
+                NetPeer *other = &net->peers[i];
+                if (i != slot && other->fd >= 0)
+                    net_message(&other->out, &other->out_size, &other->out_capacity, header,
+                                payload, header.size, NULL, 0);
+            }
+        }
+        offset += sizeof(header) + header.size;
+    }
+    memmove(peer->in, peer->in + offset, peer->in_size - offset);
+    peer->in_size -= offset;
+    return true;
+}
+
+// Writes as much as the socket takes without blocking
+static bool net_send(NetPeer *peer) {
+    size_t sent = 0;
+    while (sent < peer->out_size) {
+        const ssize_t n = send(peer->fd, peer->out + sent, peer->out_size - sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    memmove(peer->out, peer->out + sent, peer->out_size - sent);
+    peer->out_size -= sent;
+    return true;
+}
+
+// Once a frame: accepts new peers, applies what arrived and sends this
+// frame's batch. Returns the region of the canvas changed by others.
+static Bounds net_poll(Net *net, Layers *layers, UndoLog *logs, Brush *brush) {
+    Bounds changed = BOUNDS_EMPTY;
+    if (!net_active(net))
+        return changed;
+
+    if (net->listen_fd >= 0) {
+        int fd;
+        while ((fd = accept(net->listen_fd, NULL, NULL)) >= 0) {
+            int slot = 0;
+            while (slot < MAX_PEERS && net->peers[slot].fd >= 0)
+                ++slot;
+            if (slot == MAX_PEERS) {
+                fprintf(stderr, "[warning]: Turned away a peer, already hosting %d\n", MAX_PEERS);
+                close(fd);
+                continue;
+            }
+            net_set_socket_options(fd);
+            net->peers[slot].fd = fd;
+            net->pending[slot + 1] = BOUNDS_EMPTY;
+            net_welcome(net, &net->peers[slot], slot + 1, layers);
+        }
+    }
+
+    for (int i = 0; i < MAX_PEERS; ++i) {
+        NetPeer *peer = &net->peers[i];
+        if (peer->fd < 0)
+            continue;
+        if (net->batch_size > 0)
+            net_append(&peer->out, &peer->out_size, &peer->out_capacity, net->batch, net->batch_size);
+        if (!net_receive(net, i, layers, logs, brush, &changed) || !net_send(peer)) {
+            // What the peer drew so far stays, as its own undo entry
+            const int id = (net->listen_fd >= 0) ? i + 1 : 0;
+            net_commit(net, id, logs);
+            net_close_peer(peer);
+            if (net->listen_fd >= 0) {
+                fprintf(stderr, "[warning]: Peer %d left\n", id);
+            } else {
+                fprintf(stderr, "[warning]: Lost the connection to the host, drawing alone\n");
+                // Nobody else will commit pending changes now
+                for (int j = 0; j <= MAX_PEERS; ++j)
+                    net_commit(net, j, logs);
+            }
+        }
+    }
+    net->batch_size = 0;
+    return changed;
+}
+
+static void net_close(Net *net) {
+    for (int i = 0; i < MAX_PEERS; ++i)
+        net_close_peer(&net->peers[i]);
+    if (net->listen_fd >= 0)
+        close(net->listen_fd);
+    free(net->batch);
+    free(net->points);
+    *net = (Net){.listen_fd = -1};
+}
+
+// Draws the samples in a StrokeBuffer to `layer`, batching runs of segments
+// with the same radius into one canvas_draw_stroke() each. Segments are
+// added to `history` unless it's NULL, and sent to peers. Returns the
+// region that was drawn to.
+static Bounds stroke_buffer_draw(const StrokeBuffer *stroke, Layers *layers, int layer, Brush *brush,
+                                 History *history, Net *net, Color color) {
+    Canvas *canvas = &layers->canvases[layer];
+    Bounds bounds = BOUNDS_EMPTY;
+    const size_t segment_count = MAX(stroke->count - 1, 1);
+    for (size_t first = 0; first < segment_count;) {
+        const float radius = stroke_buffer_radius(stroke, first);
+        size_t last = first + 1;
+        while (last < segment_count && stroke_buffer_radius(stroke, last) == radius)
+            ++last;
+
+        // Segments first..last-1 run through points first..last
+        const size_t count = MIN(last + 1, stroke->count) - first;
+        const Bounds drawn = canvas_draw_stroke(canvas, brush, &stroke->points[first], count, radius, color);
+        if (history != NULL && !bounds_is_empty(drawn))
+            history_add_segment(history, &stroke->points[first], count, radius, color);
+        if (!bounds_is_empty(drawn))
+            net_send_stroke(net, layer, &stroke->points[first], count, radius, color);
+        bounds = bounds_union(bounds, drawn);
+        first = last;
+    }
+    return bounds;
+}
+
+//
+// Fill: Flood fill of the pixels connected to a seed pixel whose channels
+//       are all within `tolerance` of the seed's, scanline by scanline.
+//       Pixels are read from the undo log's CPU copy of the canvas, so
+//       nothing is read back from the GPU. Only when the log is kept on the
+//       GPU are the tiles the fill reaches read back, one at a time.
+//
+//       Every tile has a queue of pixels to scan from. Threads take turns
+//       filling tiles with queued pixels, at most one thread per tile, and
+//       queue the runs that continue past the tile's edge on its neighbors.
+//       Once nothing is queued the threads compose the filled tiles for
+//       uploading. Readbacks need the GL context, so with the log on the GPU
+//       the calling thread fills alone.
+//
+// log: Undo log of the canvas being filled.
+// pixels: Per tile, its pixels in the layout of the log's copy, NULL for
+//         the background.
+// loaded: Per tile, whether `pixels` was looked up yet.
+// masks: Per tile, a bit per filled pixel, NULL until the fill reaches it.
+// bounds: Per tile, the region filled in it.
+// composed: Per filled tile, the pixels of `bounds` after the fill.
+// seed: Color of the seed pixel.
+// color: Color filled with.
+// tolerance: Largest difference in any channel that still gets filled.
+// mutex: Protects everything below it. Masks, bounds and composed pixels
+//        belong to the thread working on their tile.
+// wake: Signaled when a tile is ready or the fill is done.
+// queues: Per tile, pixels to scan from.
+// busy: Per tile, whether a thread is filling it.
+// ready, ready_count: Tiles with queued pixels that nobody is filling.
+// working: Number of threads filling a tile.
+// next_compose: Next tile to compose once the fill is done.
+//
+typedef struct FillSpan {
+    int x, y;
+} FillSpan;
+
+typedef struct FillQueue {
+    FillSpan *spans;
+    size_t count, capacity;
+} FillQueue;
+
+typedef struct Fill {
+    UndoLog *log;
+    Color **pixels;
+    bool *loaded;
+    uint64_t **masks;
+    Bounds *bounds;
+    Color **composed;
+    Color seed;
+    Color color;
+    int tolerance;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    FillQueue *queues;
+    bool *busy;
+    size_t *ready;
+    size_t ready_count;
+    int working;
+    size_t next_compose;
+} Fill;
+
+static const Color *fill_tile(Fill *fill, int tx, int ty) {
+    const Canvas *canvas = fill->log->canvas;
+    const size_t i = ty*canvas->tiles_x + tx;
+    if (!fill->loaded[i]) {
+        fill->loaded[i] = true;
+        if (!undo_log_on_gpu(fill->log)) {
+            fill->pixels[i] = fill->log->copy[i];
+        } else if (canvas_has_tile(canvas, tx, ty)) {
+            // Whole tiles, so they're laid out like the copy
+            fill->pixels[i] = malloc(TILE_SIZE*TILE_SIZE*sizeof(Color));
+            canvas_read_pixels(canvas, tile_bounds(tx, ty), fill->pixels[i]);
+        }
+    }
+    return fill->pixels[i];
+}
+
+static inline bool fill_color_matches(const Fill *fill, Color c) {
+    return abs(c.r - fill->seed.r) <= fill->tolerance && abs(c.g - fill->seed.g) <= fill->tolerance &&
+           abs(c.b - fill->seed.b) <= fill->tolerance && abs(c.a - fill->seed.a) <= fill->tolerance;
+}
+
+// Whether pixel x of `row`, a row of a tile or NULL for the background, is
+// close enough to the seed color
+static inline bool fill_row_matches(const Fill *fill, const Color *row, int x) {
+    return fill_color_matches(fill, (row != NULL) ? row[x] : fill->log->canvas->background);
+}
+
+static inline bool fill_is_marked(const uint64_t *mask, int x, int y) {
+    const size_t bit = y*TILE_SIZE + x;
+    return mask[bit/64] >> (bit%64) & 1;
+}
+
+static inline void fill_mark(uint64_t *mask, int x, int y) {
+    const size_t bit = y*TILE_SIZE + x;
+    mask[bit/64] |= (uint64_t)1 << (bit%64);
+}
+
+static inline void fill_push(FillQueue *queue, int x, int y) {
+    queue->spans = grow_array(queue->spans, &queue->capacity, queue->count + 1, sizeof(FillSpan));
+    queue->spans[queue->count++] = (FillSpan){x, y};
+}
+
+// Queues x, y on its tile, called with the mutex held
+static void fill_enqueue(Fill *fill, int x, int y) {
+    const size_t tile = (y/TILE_SIZE)*fill->log->canvas->tiles_x + x/TILE_SIZE;
+    FillQueue *queue = &fill->queues[tile];
+    if (queue->count == 0 && !fill->busy[tile])
+        fill->ready[fill->ready_count++] = tile;
+    fill_push(queue, x, y);
+}
+
+// Row `y` of tile tx, ty in the layout of the log's copy, NULL for the
+// background
+static inline const Color *fill_row(Fill *fill, int tx, int ty, int y) {
+    const Color *pixels = fill_tile(fill, tx, ty);
+    return (pixels != NULL) ? &pixels[(y - ty*TILE_SIZE)*TILE_SIZE] : NULL;
+}
+
+// Fills tile `index` from the pixels in `stack` until it runs out. Pixels
+// to scan from in other tiles are added to `outgoing`. Coordinates within
+// the tile are relative to its corner.
+static void fill_scan_tile(Fill *fill, size_t index, FillQueue *stack, FillQueue *outgoing) {
+    const Canvas *canvas = fill->log->canvas;
+    const int tx = index % canvas->tiles_x;
+    const int ty = index / canvas->tiles_x;
+    const Bounds tile = bounds_intersect(tile_bounds(tx, ty), canvas_bounds(canvas));
+    const int width = tile.x1 - tile.x0;
+    const int height = tile.y1 - tile.y0;
+    if (fill->masks[index] == NULL)
+        fill->masks[index] = calloc(TILE_SIZE*TILE_SIZE/64, sizeof(uint64_t));
+    uint64_t *mask = fill->masks[index];
+
+    while (stack->count > 0) {
+        const FillSpan span = stack->spans[--stack->count];
+        const int x = span.x - tile.x0;
+        const int y = span.y - tile.y0;
+        const Color *row = fill_row(fill, tx, ty, span.y);
+        if (fill_is_marked(mask, x, y) || !fill_row_matches(fill, row, x))
+            continue;
+
+        // Widen to the whole run of matching pixels on this row of the tile,
+        // the neighbor widens it further if it goes on past the edge
+        int x0 = x, x1 = x + 1;
+        while (x0 > 0 && !fill_is_marked(mask, x0 - 1, y) && fill_row_matches(fill, row, x0 - 1))
+            --x0;
+        while (x1 < width && !fill_is_marked(mask, x1, y) && fill_row_matches(fill, row, x1))
+            ++x1;
+        for (int sx = x0; sx < x1; ++sx)
+            fill_mark(mask, sx, y);
+        fill->bounds[index] = bounds_union(fill->bounds[index],
+                                           (Bounds){tile.x0 + x0, span.y, tile.x0 + x1, span.y + 1});
+        if (x0 == 0 && tile.x0 > 0)
+            fill_push(outgoing, tile.x0 - 1, span.y);
+        if (x1 == width && tile.x1 < canvas->width)
+            fill_push(outgoing, tile.x1, span.y);
+
+        // One seed per run of matching pixels above and below. Another
+        // thread may be filling the tile past the edge, so only the colors
+        // are checked there.
+        for (int sy = y - 1; sy <= y + 1; sy += 2) {
+            const int canvas_y = tile.y0 + sy;
+            if (canvas_y < 0 || canvas_y >= canvas->height)
+                continue;
+            const bool inside = sy >= 0 && sy < height;
+            const Color *other = fill_row(fill, tx, inside ? ty : canvas_y/TILE_SIZE, canvas_y);
+            bool in_run = false;
+            for (int sx = x0; sx < x1; ++sx) {
+                const bool matches = (!inside || !fill_is_marked(mask, sx, sy)) && fill_row_matches(fill, other, sx);
+                if (matches && !in_run)
+                    fill_push(inside ? stack : outgoing, tile.x0 + sx, canvas_y);
+                in_run = matches;
+            }
+        }
+    }
+}
+
+// Composes the pixels of the region filled in tile `index`
+static void fill_compose_tile(Fill *fill, size_t index) {
+    const Bounds part = fill->bounds[index];
+    if (bounds_is_empty(part))
+        return;
+    const Canvas *canvas = fill->log->canvas;
+    const int tx = index % canvas->tiles_x;
+    const int ty = index / canvas->tiles_x;
+    const int width = part.x1 - part.x0;
+    Color *pixels = malloc((size_t)width*(part.y1 - part.y0)*sizeof(Color));
+    for (int y = part.y0; y < part.y1; ++y) {
+        const Color *row = fill_row(fill, tx, ty, y);
+        Color *dst = &pixels[(y - part.y0)*width];
+        for (int x = part.x0; x < part.x1; ++x) {
+            const int lx = x - tx*TILE_SIZE;
+            if (fill_is_marked(fill->masks[index], lx, y - ty*TILE_SIZE))
+                dst[x - part.x0] = fill->color;
+            else
+                dst[x - part.x0] = (row != NULL) ? row[lx] : canvas->background;
+        }
+    }
+    fill->composed[index] = pixels;
+}
+
+// Takes ready tiles and fills them until no tile is ready or being filled
+static void fill_work(Fill *fill) {
+    FillQueue stack = {0}, outgoing = {0};
+    pthread_mutex_lock(&fill->mutex);
+    for (;;) {
+        while (fill->ready_count == 0 && fill->working > 0)
+            pthread_cond_wait(&fill->wake, &fill->mutex);
+        if (fill->ready_count == 0)
+            break;
+
+        // Swap the tile's queue for our empty one, keeping both allocations
+        const size_t tile = fill->ready[--fill->ready_count];
+        fill->busy[tile] = true;
+        ++fill->working;
+        const FillQueue queue = fill->queues[tile];
+        fill->queues[tile] = stack;
+        stack = queue;
+        pthread_mutex_unlock(&fill->mutex);
+
+        fill_scan_tile(fill, tile, &stack, &outgoing);
+
+        pthread_mutex_lock(&fill->mutex);
+        fill->busy[tile] = false;
+        if (fill->queues[tile].count > 0)
+            fill->ready[fill->ready_count++] = tile;
+        for (size_t i = 0; i < outgoing.count; ++i)
+            fill_enqueue(fill, outgoing.spans[i].x, outgoing.spans[i].y);
+        outgoing.count = 0;
+        --fill->working;
+        pthread_cond_broadcast(&fill->wake);
+    }
+
+    const size_t tile_count = canvas_tile_count(fill->log->canvas);
+    while (fill->next_compose < tile_count) {
+        const size_t tile = fill->next_compose++;
+        pthread_mutex_unlock(&fill->mutex);
+        fill_compose_tile(fill, tile);
+        pthread_mutex_lock(&fill->mutex);
+    }
+    pthread_mutex_unlock(&fill->mutex);
+    free(stack.spans);
+    free(outgoing.spans);
+}
+
+static void *fill_main(void *arg) {
+    fill_work(arg);
+    return NULL;
+}
+
+// Flood fills the canvas of `log` from x, y with `color`, premultiplied for
+// upper layers. The log has to be up to date with the canvas, so the
+// current stroke must be pushed first. Returns the region that was filled.
+static Bounds canvas_fill(UndoLog *log, int x, int y, Color color, int tolerance, bool premultiply) {
+    Canvas *canvas = log->canvas;
+    if (x < 0 || y < 0 || x >= canvas->width || y >= canvas->height)
+        return BOUNDS_EMPTY;
+    // Readbacks in flight still have to land in the copy
+    undo_log_finish(log);
+
+    // Filled pixels are replaced rather than blended, so do what the
+    // brush's blend would leave
+    if (premultiply)
+        color = (Color){color.r*color.a/255, color.g*color.a/255, color.b*color.a/255, color.a};
+
+    const size_t tile_count = canvas_tile_count(canvas);
+    Fill fill = {
+        .log = log,
+        .pixels = calloc(tile_count, sizeof(Color *)),
+        .loaded = calloc(tile_count, sizeof(bool)),
+        .masks = calloc(tile_count, sizeof(uint64_t *)),
+        .bounds = malloc(tile_count*sizeof(Bounds)),
+        .composed = calloc(tile_count, sizeof(Color *)),
+        .color = color,
+        .tolerance = tolerance,
+        .queues = calloc(tile_count, sizeof(FillQueue)),
+        .busy = calloc(tile_count, sizeof(bool)),
+        .ready = malloc(tile_count*sizeof(size_t)),
+    };
+    for (size_t i = 0; i < tile_count; ++i)
+        fill.bounds[i] = BOUNDS_EMPTY;
+    const Color *seed_tile = fill_tile(&fill, x/TILE_SIZE, y/TILE_SIZE);
+    fill.seed = (seed_tile != NULL) ? seed_tile[(y%TILE_SIZE)*TILE_SIZE + x%TILE_SIZE] : canvas->background;
+
+    // Threads can share the copy once every tile is looked up
+    int thread_count = 0;
+    if (!undo_log_on_gpu(log)) {
+        for (int ty = 0; ty < canvas->tiles_y; ++ty)
+            for (int tx = 0; tx < canvas->tiles_x; ++tx)
+                fill_tile(&fill, tx, ty);
+        thread_count = CLAMP(0, sysconf(_SC_NPROCESSORS_ONLN) - 1, MAX_FILL_THREADS);
+    }
+
+    // Filling with the exact color that's there changes nothing
+    if (tolerance > 0 || !color_equal(fill.seed, color)) {
+        pthread_mutex_init(&fill.mutex, NULL);
+        pthread_cond_init(&fill.wake, NULL);
+        fill_enqueue(&fill, x, y);
+        pthread_t threads[MAX_FILL_THREADS];
+        int started = 0;
+        while (started < thread_count && pthread_create(&threads[started], NULL, fill_main, &fill) == 0)
+            ++started;
+        fill_work(&fill);
+        for (int i = 0; i < started; ++i)
+            pthread_join(threads[i], NULL);
+        pthread_cond_destroy(&fill.wake);
+        pthread_mutex_destroy(&fill.mutex);
+    }
+
+    // Upload the filled tiles, the rest of each tile is written back as is
+    Bounds bounds = BOUNDS_EMPTY;
+    for (size_t i = 0; i < tile_count; ++i) {
+        if (fill.composed[i] == NULL)
+            continue;
+        canvas_write_pixels(canvas, fill.bounds[i], fill.composed[i]);
+        bounds = bounds_union(bounds, fill.bounds[i]);
+    }
+
+    for (size_t i = 0; i < tile_count; ++i) {
+        free(fill.composed[i]);
+        free(fill.masks[i]);
+        free(fill.queues[i].spans);
+        if (undo_log_on_gpu(log))
+            free(fill.pixels[i]);
+    }
+    free(fill.ready);
+    free(fill.busy);
+    free(fill.queues);
+    free(fill.composed);
+    free(fill.bounds);
+    free(fill.masks);
+    free(fill.loaded);
+    free(fill.pixels);
+    return bounds;
+}
+
+//
+// Project: A project file mapped into memory. Project files hold the canvas
+//          tiles, the undo history and the palette, run-length encoded like
+//          undo entries. Canvas tiles are only decoded and uploaded once they
+//          scroll into view, so opening a large canvas costs next to nothing.
+//
+// data, size: The mapped file, NULL once all tiles have been uploaded.
+// header: Copy of the file header.
+// pending: Per canvas tile, whether it is yet to be uploaded.
+// pending_count: Number of pending tiles.
+//
+// File layout, all integers in host byte order:
+//
+//     ProjectHeader
+//     Encoded pixels of canvas tiles and undo entries
+//     ProjectTile for every tile of each clear entry
+//     ProjectTile for every canvas tile, at `tiles_offset`
+//     ProjectEntry for every undo entry oldest first, at `entries_offset`
+//
+
+#define PROJECT_MAGIC "beakprj2"
+
+// entry_count: Number of undo entries, not counting the blank canvas.
+// applied: Number of those entries that are applied, the rest can be redone.
+typedef struct ProjectHeader {
+    char magic[8];
+    uint32_t width, height;
+    uint32_t tile_size;
+    Color background;
+    Palette palette;
+    uint32_t entry_count;
+    uint32_t applied;
+    uint64_t tiles_offset;
+    uint64_t entries_offset;
+} ProjectHeader;
+
+// Encoded pixels of a tile, clipped to the canvas. Blank tiles have no pixels.
+typedef struct ProjectTile {
+    uint64_t offset;
+    uint64_t size;
+} ProjectTile;
+
+// Undo entry, `offset` points to the encoded pixels of the region, or to the
+// tiles of the canvas for clear entries.
+typedef struct ProjectEntry {
+    int32_t x, y;
+    int32_t width, height;
+    uint32_t clear;
+    uint64_t offset;
+    uint64_t size;
+} ProjectEntry;
+
+typedef struct Project {
+    const unsigned char *data;
+    size_t size;
+    ProjectHeader header;
+    bool *pending;
+    size_t pending_count;
+} Project;
+
+static inline bool project_contains(const Project *project, uint64_t offset, uint64_t size) {
+    return offset <= project->size && size <= project->size - offset;
+}
+
+static inline size_t project_tile_count(const ProjectHeader *header) {
+    return (size_t)((header->width + TILE_SIZE - 1)/TILE_SIZE)*((header->height + TILE_SIZE - 1)/TILE_SIZE);
+}
+
+static void project_unmap(Project *project) {
+    if (project->data != NULL)
+        munmap((void *)project->data, project->size);
+    free(project->pending);
+    *project = (Project){0};
+}
+
+// Maps the project at `path`, missing projects are silently ignored.
+static bool project_map(Project *project, const char *path) {
+    *project = (Project){0};
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive on its own
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "[error]: Failed to map project '%s'\n", path);
+        return false;
+    }
+    project->data = data;
+    project->size = st.st_size;
+
+    ProjectHeader *header = &project->header;
+    if (project->size < sizeof(*header) ||
+        (memcpy(header, project->data, sizeof(*header)),
+         memcmp(header->magic, PROJECT_MAGIC, sizeof(header->magic)) != 0) ||
+        header->tile_size != TILE_SIZE || header->width == 0 || header->height == 0 ||
+        !palette_valid(&header->palette) ||
+        !project_contains(project, header->tiles_offset, project_tile_count(header)*sizeof(ProjectTile)) ||
+        !project_contains(project, header->entries_offset, (uint64_t)header->entry_count*sizeof(ProjectEntry)) ||
+        header->applied > header->entry_count) {
+        fprintf(stderr, "[error]: '%s' is not a valid beak project\n", path);
+        project_unmap(project);
+        return false;
+    }
+
+    project->pending_count = project_tile_count(header);
+    project->pending = malloc(project->pending_count*sizeof(bool));
+    for (size_t i = 0; i < project->pending_count; ++i)
+        project->pending[i] = true;
+    return true;
+}
+
+// Decodes the pixels of tile `tx, ty` from the tile table at `table`, clipped
+// to the canvas. Returns false if the tile is blank.
+static bool project_decode_tile(const Project *project, uint64_t table, int tx, int ty, Color *pixels) {
+    const ProjectHeader *header = &project->header;
+    const int tiles_x = (header->width + TILE_SIZE - 1)/TILE_SIZE;
+    ProjectTile tile;
+    memcpy(&tile, project->data + table + ((size_t)ty*tiles_x + tx)*sizeof(tile), sizeof(tile));
+
+    const Bounds part = bounds_intersect(tile_bounds(tx, ty), (Bounds){0, 0, header->width, header->height});
+    const size_t count = (size_t)(part.x1 - part.x0)*(part.y1 - part.y0);
+    if (tile.size == 0 || tile.size > rle_bound(count) || !project_contains(project, tile.offset, tile.size))
+        return false;
+    rle_decode(project->data + tile.offset, tile.size, pixels, count);
+    return true;
+}
+
+// Decodes the tiles in the tile table at `table` into `tiles`, unallocated
+// tiles are left blank. The CPU copy of them goes to `copy` if not NULL.
+static void project_load_tiles(const Project *project, uint64_t table, Canvas *tiles, Pool *pool, Color **copy) {
+    Color *pixels = malloc(TILE_SIZE*TILE_SIZE*sizeof(Color));
+    for (int ty = 0; ty < tiles->tiles_y; ++ty) {
+        for (int tx = 0; tx < tiles->tiles_x; ++tx) {
+            if (!project_decode_tile(project, table, tx, ty, pixels))
+                continue;
+            const Bounds part = bounds_intersect(tile_bounds(tx, ty), canvas_bounds(tiles));
+            canvas_write_pixels(tiles, part, pixels);
+            if (copy == NULL)
+                continue;
+
+            Color *tile = pool_alloc(pool, TILE_SIZE*TILE_SIZE*sizeof(Color));
+            for (size_t i = 0; i < TILE_SIZE*TILE_SIZE; ++i)
+                tile[i] = tiles->background;
+            const int width = part.x1 - part.x0;
+            for (int y = 0; y < part.y1 - part.y0; ++y)
+                memcpy(&tile[y*TILE_SIZE], &pixels[y*width], width*sizeof(Color));
+            copy[ty*tiles->tiles_x + tx] = tile;
+        }
+    }
+    free(pixels);
+}
+
+// Uploads the pending canvas tiles touching `bounds`, along with the copy of
+// them kept by the undo log. The project is unmapped once nothing is pending.
+static void project_stream(Project *project, UndoLog *log, Bounds bounds) {
+    Canvas *canvas = log->canvas;
+    bounds = bounds_intersect(bounds, canvas_bounds(canvas));
+    if (project->pending_count == 0 || bounds_is_empty(bounds))
+        return;
+
+    Color *pixels = malloc(TILE_SIZE*TILE_SIZE*sizeof(Color));
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            const size_t i = ty*canvas->tiles_x + tx;
+            if (!project->pending[i])
+                continue;
+            project->pending[i] = false;
+            --project->pending_count;
+            if (!project_decode_tile(project, project->header.tiles_offset, tx, ty, pixels))
+                continue;
+
+            const Bounds part = bounds_intersect(tile_bounds(tx, ty), canvas_bounds(canvas));
+            canvas_write_pixels(canvas, part, pixels);
+            if (undo_log_on_gpu(log)) {
+                canvas_write_pixels(&log->committed, part, pixels);
+            } else {
+                Color *tile = pool_alloc(&log->pool, TILE_SIZE*TILE_SIZE*sizeof(Color));
+                for (size_t j = 0; j < TILE_SIZE*TILE_SIZE; ++j)
+                    tile[j] = canvas->background;
+                const int width = part.x1 - part.x0;
+                for (int y = 0; y < part.y1 - part.y0; ++y)
+                    memcpy(&tile[y*TILE_SIZE], &pixels[y*width], width*sizeof(Color));
+                log->copy[i] = tile;
+            }
+        }
+    }
+    free(pixels);
+
+    if (project->pending_count == 0)
+        project_unmap(project);
+}
+
+// Pushes the undo history of the project on top of the blank canvas entry.
+// Entries are kept run-length encoded until they're needed, so this is
+// cheap except for clear entries. If the log is too small the oldest applied
+// entries are dropped first, then the newest ones that can be redone.
+static void project_load_history(const Project *project, UndoLog *log) {
+    const ProjectHeader *header = &project->header;
+    size_t first = 0;
+    size_t last = header->entry_count;
+    const size_t capacity = log->size - 1;
+    if (last - first > capacity)
+        first = MIN((size_t)header->applied, last - capacity);
+    if (last - first > capacity)
+        last = first + capacity;
+
+    Canvas *canvas = log->canvas;
+    const size_t tile_count = canvas_tile_count(canvas);
+    size_t selected = log->selected;
+    for (size_t n = first; n < last; ++n) {
+        ProjectEntry src;
+        memcpy(&src, project->data + header->entries_offset + n*sizeof(src), sizeof(src));
+        const Bounds bounds = {src.x, src.y, src.x + src.width, src.y + src.height};
+        if (src.width <= 0 || src.height <= 0 ||
+            bounds.x0 < 0 || bounds.y0 < 0 || bounds.x1 > canvas->width || bounds.y1 > canvas->height ||
+            (src.clear ? !project_contains(project, src.offset, tile_count*sizeof(ProjectTile))
+                       : src.size > rle_bound((size_t)src.width*src.height) || !project_contains(project, src.offset, src.size))) {
+            fprintf(stderr, "[warning]: Project undo history is invalid, dropping the rest of it\n");
+            break;
+        }
+
+        UndoEntry *entry = undo_log_begin_push(log);
+        *entry = (UndoEntry){
+            .x = src.x,
+            .y = src.y,
+            .width = src.width,
+            .height = src.height,
+            .clear = src.clear,
+        };
+        if (src.clear) {
+            Canvas tiles = *canvas;
+            tiles.tiles = calloc(tile_count, sizeof(RenderTexture2D));
+            Color **copy = NULL;
+            if (!undo_log_on_gpu(log))
+                copy = calloc(tile_count, sizeof(Color *));
+            project_load_tiles(project, src.offset, &tiles, &log->pool, copy);
+            entry->tiles = tiles.tiles;
+            entry->copy_tiles = copy;
+            if (undo_log_on_gpu(log)) {
+                tiles.tiles = calloc(tile_count, sizeof(RenderTexture2D));
+                project_load_tiles(project, src.offset, &tiles, &log->pool, NULL);
+                entry->committed_tiles = tiles.tiles;
+            }
+        } else {
+            // Spilled GPU entries are compressed CPU entries too, so this
+            // works in both modes
+            entry->compressed = pool_alloc(&log->pool, src.size);
+            memcpy(entry->compressed, project->data + src.offset, src.size);
+            entry->compressed_size = src.size;
+        }
+        undo_log_end_push(log);
+
+        if (n < header->applied)
+            selected = log->selected;
+    }
+    log->selected = selected;
+}
+
+// Writes the encoded pixels of `tiles` followed by their tile table, returns
+// the offset of the table. Tiles still pending in `project` are copied
+// without decoding them.
+static uint64_t project_write_tiles(FILE *file, const Canvas *tiles, const Project *project, Color *pixels, unsigned char *data) {
+    const size_t tile_count = canvas_tile_count(tiles);
+    ProjectTile *table = calloc(tile_count, sizeof(ProjectTile));
+    for (int ty = 0; ty < tiles->tiles_y; ++ty) {
+        for (int tx = 0; tx < tiles->tiles_x; ++tx) {
+            const size_t i = ty*tiles->tiles_x + tx;
+            if (project != NULL && project->pending != NULL && project->pending[i]) {
+                ProjectTile tile;
+                memcpy(&tile, project->data + project->header.tiles_offset + i*sizeof(tile), sizeof(tile));
+                if (tile.size == 0 || !project_contains(project, tile.offset, tile.size))
+                    continue;
+                table[i] = (ProjectTile){ftell(file), tile.size};
+                fwrite(project->data + tile.offset, 1, tile.size, file);
+                continue;
+            }
+            if (!canvas_has_tile(tiles, tx, ty))
+                continue;
+            const Bounds part = bounds_intersect(tile_bounds(tx, ty), canvas_bounds(tiles));
+            canvas_read_pixels(tiles, part, pixels);
+            const size_t size = rle_encode(pixels, (size_t)(part.x1 - part.x0)*(part.y1 - part.y0), data);
+            table[i] = (ProjectTile){ftell(file), size};
+            fwrite(data, 1, size, file);
+        }
+    }
+    const uint64_t offset = ftell(file);
+    fwrite(table, sizeof(ProjectTile), tile_count, file);
+    free(table);
+    return offset;
+}
+
+// Saves the canvas, undo history and palette to `path`. The project is
+// written next to it first and moved into place once complete, so a
+// failed save never loses the previous one.
+static bool project_save(const char *path, UndoLog *log, const Palette *palette, const Project *project) {
+    const Canvas *canvas = log->canvas;
+    char *tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+    sprintf(tmp_path, "%s.tmp", path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "[error]: Failed to open '%s' for writing\n", tmp_path);
+        free(tmp_path);
+        return false;
+    }
+
+    // Entries need to be settled before their pixels can be read
+    undo_log_finish(log);
+
+    ProjectHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PROJECT_MAGIC, sizeof(header.magic));
+    header.width = canvas->width;
+    header.height = canvas->height;
+    header.tile_size = TILE_SIZE;
+    header.background = canvas->background;
+    header.palette = *palette;
+    fwrite(&header, sizeof(header), 1, file);
+
+    // The oldest entry is the state the log started from, it can't be
+    // undone so it isn't saved
+    const size_t oldest = (log->top + log->size - log->used_size) % log->size;
+    header.entry_count = log->used_size - 1;
+    header.applied = (log->selected + log->size - oldest) % log->size;
+    ProjectEntry *entries = calloc(MAX(header.entry_count, 1), sizeof(ProjectEntry));
+
+    Color *pixels = malloc(MAX((size_t)canvas->width*canvas->height, TILE_SIZE*TILE_SIZE)*sizeof(Color));
+    unsigned char *data = malloc(rle_bound(MAX((size_t)canvas->width*canvas->height, TILE_SIZE*TILE_SIZE)));
+    for (size_t n = 0; n < header.entry_count; ++n) {
+        const size_t i = (oldest + 1 + n) % log->size;
+        undo_log_wait(log, i);
+        const UndoEntry *entry = &log->entries[i];
+        ProjectEntry *dst = &entries[n];
+        *dst = (ProjectEntry){
+            .x = entry->x,
+            .y = entry->y,
+            .width = entry->width,
+            .height = entry->height,
+            .clear = entry->clear,
+        };
+
+        if (entry->clear) {
+            Canvas tiles = *canvas;
+            tiles.tiles = entry->tiles;
+            dst->offset = project_write_tiles(file, &tiles, NULL, pixels, data);
+            continue;
+        }
+
+        const size_t count = (size_t)entry->width*entry->height;
+        const unsigned char *encoded = entry->compressed;
+        dst->size = entry->compressed_size;
+        if (encoded == NULL) {
+            const Color *src = entry->image.data;
+            if (src == NULL) {
+                rlEnableFramebuffer(entry->texture.id);
+                glReadPixels(0, 0, entry->width, entry->height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+                rlDisableFramebuffer();
+                src = pixels;
+            }
+            dst->size = rle_encode(src, count, data);
+            encoded = data;
+        }
+        dst->offset = ftell(file);
+        fwrite(encoded, 1, dst->size, file);
+    }
+
+    header.tiles_offset = project_write_tiles(file, canvas, project, pixels, data);
+    header.entries_offset = ftell(file);
+    fwrite(entries, sizeof(ProjectEntry), header.entry_count, file);
+    free(data);
+    free(pixels);
+    free(entries);
+
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    const bool ok = !ferror(file);
+    if (fclose(file) != 0 || !ok || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "[error]: Failed to save project to '%s'\n", path);
+        remove(tmp_path);
+        free(tmp_path);
+        return false;
+    }
+    free(tmp_path);
+    return true;
+}
+
+#endif // BEAK_NO_MAIN
+
+//
+// CPU rasterizer: Draws strokes like the brush shader without a GPU, for
+// headless rendering. Every pixel center is evaluated with the shader's
+// signed distance and blended with its blend function in float, so results
+// match the GPU up to its rounding of the final 8-bit values. Pixel rows are
+// vectorized eight at a time with AVX2, four at a time with SSE2 or NEON,
+// falling back to scalar code. Only the tools built on top of beak.c use it,
+// see bench.c.
+//
+
+#ifdef BEAK_NO_MAIN
+
+// f32xn: F32XN_LANES floats. f32xn_ramp(x) is x, x + 1, x + 2, ...
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define F32XN_LANES 8
+typedef __m256 f32xn;
+#define f32xn_set1(x) _mm256_set1_ps(x)
+#define f32xn_ramp(x) _mm256_add_ps(_mm256_set1_ps(x), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7))
+#define f32xn_add(a, b) _mm256_add_ps(a, b)
+#define f32xn_sub(a, b) _mm256_sub_ps(a, b)
+#define f32xn_mul(a, b) _mm256_mul_ps(a, b)
+#define f32xn_div(a, b) _mm256_div_ps(a, b)
+#define f32xn_min(a, b) _mm256_min_ps(a, b)
+#define f32xn_max(a, b) _mm256_max_ps(a, b)
+#define f32xn_sqrt(a) _mm256_sqrt_ps(a)
+#define f32xn_store(p, a) _mm256_storeu_ps(p, a)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define F32XN_LANES 4
+typedef __m128 f32xn;
+#define f32xn_set1(x) _mm_set1_ps(x)
+#define f32xn_ramp(x) _mm_add_ps(_mm_set1_ps(x), _mm_setr_ps(0, 1, 2, 3))
+#define f32xn_add(a, b) _mm_add_ps(a, b)
+#define f32xn_sub(a, b) _mm_sub_ps(a, b)
+#define f32xn_mul(a, b) _mm_mul_ps(a, b)
+#define f32xn_div(a, b) _mm_div_ps(a, b)
+#define f32xn_min(a, b) _mm_min_ps(a, b)
+#define f32xn_max(a, b) _mm_max_ps(a, b)
+#define f32xn_sqrt(a) _mm_sqrt_ps(a)
+#define f32xn_store(p, a) _mm_storeu_ps(p, a)
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define F32XN_LANES 4
+typedef float32x4_t f32xn;
+#define f32xn_set1(x) vdupq_n_f32(x)
+#define f32xn_ramp(x) vaddq_f32(vdupq_n_f32(x), (float32x4_t){0, 1, 2, 3})
+#define f32xn_add(a, b) vaddq_f32(a, b)
+#define f32xn_sub(a, b) vsubq_f32(a, b)
+#define f32xn_mul(a, b) vmulq_f32(a, b)
+#define f32xn_div(a, b) vdivq_f32(a, b)
+#define f32xn_min(a, b) vminq_f32(a, b)
+#define f32xn_max(a, b) vmaxq_f32(a, b)
+#define f32xn_sqrt(a) vsqrtq_f32(a)
+#define f32xn_store(p, a) vst1q_f32(p, a)
+#else
+#define F32XN_LANES 4
+typedef struct f32xn { float v[F32XN_LANES]; } f32xn;
+#define F32XN_MAP(expr) do { for (int k = 0; k < F32XN_LANES; ++k) r.v[k] = (expr); } while (0)
+static inline f32xn f32xn_set1(float x) { f32xn r; F32XN_MAP(x); return r; }
+static inline f32xn f32xn_ramp(float x) { f32xn r; F32XN_MAP(x + k); return r; }
+static inline f32xn f32xn_add(f32xn a, f32xn b) { f32xn r; F32XN_MAP(a.v[k] + b.v[k]); return r; }
+static inline f32xn f32xn_sub(f32xn a, f32xn b) { f32xn r; F32XN_MAP(a.v[k] - b.v[k]); return r; }
+static inline f32xn f32xn_mul(f32xn a, f32xn b) { f32xn r; F32XN_MAP(a.v[k]*b.v[k]); return r; }
+static inline f32xn f32xn_div(f32xn a, f32xn b) { f32xn r; F32XN_MAP(a.v[k]/b.v[k]); return r; }
+static inline f32xn f32xn_min(f32xn a, f32xn b) { f32xn r; F32XN_MAP(MIN(a.v[k], b.v[k])); return r; }
+static inline f32xn f32xn_max(f32xn a, f32xn b) { f32xn r; F32XN_MAP(MAX(a.v[k], b.v[k])); return r; }
+static inline f32xn f32xn_sqrt(f32xn a) { f32xn r; F32XN_MAP(sqrtf(a.v[k])); return r; }
+static inline void f32xn_store(float *p, f32xn a) { memcpy(p, a.v, sizeof(a.v)); }
+#undef F32XN_MAP
+#endif
+
+// Most worker threads the rasterizer starts
+#define MAX_RASTER_THREADS 16
+
+//
+// RasterCanvas: CPU counterpart of Canvas. Tiles are arrays of
+//               TILE_SIZE x TILE_SIZE pixels like the canvas copy of the undo
+//               log, NULL while unallocated.
+//
+typedef struct RasterCanvas {
+    int width, height;
+    int tiles_x, tiles_y;
+    Color **tiles;
+    Color background;
+} RasterCanvas;
+
+static void raster_canvas_init(RasterCanvas *canvas, int width, int height, Color background) {
+    canvas->width = width;
+    canvas->height = height;
+    canvas->tiles_x = (width + TILE_SIZE - 1)/TILE_SIZE;
+    canvas->tiles_y = (height + TILE_SIZE - 1)/TILE_SIZE;
+    canvas->tiles = calloc((size_t)canvas->tiles_x*canvas->tiles_y, sizeof(Color *));
+    canvas->background = background;
+}
+
+static void raster_canvas_unload(RasterCanvas *canvas) {
+    for (size_t i = 0; i < (size_t)canvas->tiles_x*canvas->tiles_y; ++i)
+        free(canvas->tiles[i]);
+    free(canvas->tiles);
+    canvas->tiles = NULL;
+}
+
+static inline Bounds raster_canvas_bounds(const RasterCanvas *canvas) {
+    return (Bounds){0, 0, canvas->width, canvas->height};
+}
+
+// Draws the capsules overlapping tile `index`, in order
+static void raster_tile(RasterCanvas *canvas, size_t index, const BrushInstance *instances, size_t count) {
+    const int tx = index % canvas->tiles_x;
+    const int ty = index / canvas->tiles_x;
+    const Bounds tile = bounds_intersect(tile_bounds(tx, ty), raster_canvas_bounds(canvas));
+    Color *pixels = canvas->tiles[index];
+
+    for (size_t i = 0; i < count; ++i) {
+        const BrushInstance *capsule = &instances[i];
+        const Bounds bounds = bounds_intersect(bounds_from_capsule(capsule->start, capsule->end, capsule->radius), tile);
+        if (bounds_is_empty(bounds))
+            continue;
+
+        const float bax = capsule->end.x - capsule->start.x;
+        const float bay = capsule->end.y - capsule->start.y;
+        const f32xn ba_x = f32xn_set1(bax);
+        const f32xn ba_y = f32xn_set1(bay);
+        const f32xn ba_dot = f32xn_set1(MAX(bax*bax + bay*bay, 1e-6f));
+        const f32xn radius = f32xn_set1(capsule->radius);
+        const f32xn zero = f32xn_set1(0.0f);
+        const f32xn one = f32xn_set1(1.0f);
+        const f32xn half = f32xn_set1(0.5f);
+        // Transparent colors erase like on the GPU
+        const bool erase = capsule->color.a == 0;
+        const f32xn color_a = f32xn_set1(erase ? 1.0f : capsule->color.a/255.0f);
+        const float r = capsule->color.r/255.0f;
+        const float g = capsule->color.g/255.0f;
+        const float b = capsule->color.b/255.0f;
+
+        for (int y = bounds.y0; y < bounds.y1; ++y) {
+            // Fragments are shaded at pixel centers
+            const f32xn pa_y = f32xn_set1(y + 0.5f - capsule->start.y);
+            Color *row = &pixels[(y - ty*TILE_SIZE)*TILE_SIZE - tx*TILE_SIZE];
+            for (int x = bounds.x0; x < bounds.x1; x += F32XN_LANES) {
+                const f32xn pa_x = f32xn_ramp(x + 0.5f - capsule->start.x);
+                f32xn h = f32xn_div(f32xn_add(f32xn_mul(pa_x, ba_x), f32xn_mul(pa_y, ba_y)), ba_dot);
+                h = f32xn_min(f32xn_max(h, zero), one);
+                const f32xn dx = f32xn_sub(pa_x, f32xn_mul(ba_x, h));
+                const f32xn dy = f32xn_sub(pa_y, f32xn_mul(ba_y, h));
+                const f32xn dist = f32xn_sub(f32xn_sqrt(f32xn_add(f32xn_mul(dx, dx), f32xn_mul(dy, dy))), radius);
+                const f32xn coverage = f32xn_min(f32xn_max(f32xn_sub(half, dist), zero), one);
+                float alpha[F32XN_LANES];
+                f32xn_store(alpha, f32xn_mul(color_a, coverage));
+
+                // Blend like glBlendFuncSeparate(SRC_ALPHA, ONE_MINUS_SRC_ALPHA,
+                // ONE, ONE_MINUS_SRC_ALPHA)
+                for (int k = 0; k < F32XN_LANES && x + k < bounds.x1; ++k) {
+                    const float a = alpha[k];
+                    if (a <= 0.0f)
+                        continue;
+                    Color *dst = &row[x + k];
+                    if (erase) {
+                        dst->r = dst->r/255.0f*(1.0f - a)*255.0f + 0.5f;
+                        dst->g = dst->g/255.0f*(1.0f - a)*255.0f + 0.5f;
+                        dst->b = dst->b/255.0f*(1.0f - a)*255.0f + 0.5f;
+                        dst->a = dst->a/255.0f*(1.0f - a)*255.0f + 0.5f;
+                        continue;
+                    }
+                    dst->r = (r*a + dst->r/255.0f*(1.0f - a))*255.0f + 0.5f;
+                    dst->g = (g*a + dst->g/255.0f*(1.0f - a))*255.0f + 0.5f;
+                    dst->b = (b*a + dst->b/255.0f*(1.0f - a))*255.0f + 0.5f;
+                    dst->a = (a + dst->a/255.0f*(1.0f - a))*255.0f + 0.5f;
+                }
+            }
+        }
+    }
+}
+
+//
+// Rasterizer: Draws strokes to a RasterCanvas with the tiles they overlap
+//             split across worker threads. The calling thread works on
+//             tiles too, and waits for the rest before returning.
+//
+// threads, thread_count: The worker threads.
+// mutex: Protects everything below it.
+// work: Signaled when a new stroke is started or the workers should quit.
+// done: Signaled when the last tile of a stroke is finished.
+// canvas, instances, instance_count, tiles, tile_count: The stroke being
+//                                                       drawn.
+// next: Index of the next tile to hand out.
+// finished: Number of tiles finished.
+// generation: Incremented for every stroke so workers notice a new one.
+// quit: Tells the workers to exit.
+// instance_capacity, tile_capacity: Room in `instances` and `tiles`.
+//
+typedef struct Rasterizer {
+    pthread_t threads[MAX_RASTER_THREADS];
+    int thread_count;
 
-#define MIN(a, b) \
-    ((a < b) ? a : b)
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    RasterCanvas *canvas;
+    BrushInstance *instances;
+    size_t instance_count;
+    size_t *tiles;
+    size_t tile_count;
+    size_t next;
+    size_t finished;
+    size_t generation;
+    bool quit;
 
-#define CLAMP(lower, x, upper) \
-    (MIN(upper, MAX(lower, x)))
+    size_t instance_capacity;
+    size_t tile_capacity;
+} Rasterizer;
+
+// Hands out tiles of stroke `generation` until there are none left, called
+// with the mutex held. Workers woken for an earlier stroke only get here once
+// it is finished, and must not take tiles of a later one.
+static void rasterizer_work(Rasterizer *rasterizer, size_t generation) {
+    while (rasterizer->generation == generation && rasterizer->next < rasterizer->tile_count) {
+        const size_t tile = rasterizer->tiles[rasterizer->next++];
+        pthread_mutex_unlock(&rasterizer->mutex);
+        raster_tile(rasterizer->canvas, tile, rasterizer->instances, rasterizer->instance_count);
+        pthread_mutex_lock(&rasterizer->mutex);
+        if (++rasterizer->finished == rasterizer->tile_count)
+            pthread_cond_broadcast(&rasterizer->done);
+    }
+}
+
+static void *rasterizer_main(void *arg) {
+    Rasterizer *rasterizer = arg;
+    size_t generation = 0;
+    pthread_mutex_lock(&rasterizer->mutex);
+    for (;;) {
+        while (rasterizer->generation == generation && !rasterizer->quit)
+            pthread_cond_wait(&rasterizer->work, &rasterizer->mutex);
+        if (rasterizer->quit)
+            break;
+        generation = rasterizer->generation;
+        rasterizer_work(rasterizer, generation);
+    }
+    pthread_mutex_unlock(&rasterizer->mutex);
+    return NULL;
+}
+
+// Starts `thread_count` workers, 0 for one per CPU besides the caller
+static void rasterizer_start(Rasterizer *rasterizer, int thread_count) {
+    *rasterizer = (Rasterizer){0};
+    if (thread_count <= 0)
+        thread_count = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    thread_count = CLAMP(0, thread_count, MAX_RASTER_THREADS);
+
+    pthread_mutex_init(&rasterizer->mutex, NULL);
+    pthread_cond_init(&rasterizer->work, NULL);
+    pthread_cond_init(&rasterizer->done, NULL);
+    for (int i = 0; i < thread_count; ++i) {
+        if (pthread_create(&rasterizer->threads[i], NULL, rasterizer_main, rasterizer) != 0) {
+            fprintf(stderr, "[warning]: Failed to start rasterizer thread, using %d\n", i);
+            break;
+        }
+        ++rasterizer->thread_count;
+    }
+}
+
+static void rasterizer_stop(Rasterizer *rasterizer) {
+    pthread_mutex_lock(&rasterizer->mutex);
+    rasterizer->quit = true;
+    pthread_cond_broadcast(&rasterizer->work);
+    pthread_mutex_unlock(&rasterizer->mutex);
+    for (int i = 0; i < rasterizer->thread_count; ++i)
+        pthread_join(rasterizer->threads[i], NULL);
+    pthread_cond_destroy(&rasterizer->done);
+    pthread_cond_destroy(&rasterizer->work);
+    pthread_mutex_destroy(&rasterizer->mutex);
+    free(rasterizer->instances);
+    free(rasterizer->tiles);
+}
+
+// CPU version of canvas_draw_stroke(), returns the region that was drawn to
+static Bounds raster_draw_stroke(Rasterizer *rasterizer, RasterCanvas *canvas,
+                                 const Vector2 *points, size_t count, float radius, Color color) {
+    Bounds bounds = BOUNDS_EMPTY;
+    for (size_t i = 0; i < count; ++i)
+        bounds = bounds_union(bounds, bounds_from_capsule(points[i], points[i], radius));
+    bounds = bounds_intersect(bounds, raster_canvas_bounds(canvas));
+    if (bounds_is_empty(bounds))
+        return BOUNDS_EMPTY;
+
+    // Every tile of the last stroke is finished, so no worker is outside the
+    // mutex and the stroke can be replaced while holding it
+    pthread_mutex_lock(&rasterizer->mutex);
+    rasterizer->instances = grow_array(rasterizer->instances, &rasterizer->instance_capacity,
+                                       count, sizeof(BrushInstance));
+    rasterizer->instance_count = fill_instances(rasterizer->instances, points, count, radius, color);
+
+    // Allocate tiles up front, workers only write pixels
+    rasterizer->tile_count = 0;
+    for (int ty = bounds.y0/TILE_SIZE; ty <= (bounds.y1 - 1)/TILE_SIZE; ++ty) {
+        for (int tx = bounds.x0/TILE_SIZE; tx <= (bounds.x1 - 1)/TILE_SIZE; ++tx) {
+            const size_t i = ty*canvas->tiles_x + tx;
+            if (canvas->tiles[i] == NULL) {
+                canvas->tiles[i] = malloc(TILE_SIZE*TILE_SIZE*sizeof(Color));
+                for (size_t j = 0; j < TILE_SIZE*TILE_SIZE; ++j)
+                    canvas->tiles[i][j] = canvas->background;
+            }
+            rasterizer->tiles = grow_array(rasterizer->tiles, &rasterizer->tile_capacity,
+                                           rasterizer->tile_count + 1, sizeof(size_t));
+            rasterizer->tiles[rasterizer->tile_count++] = i;
+        }
+    }
+
+    rasterizer->canvas = canvas;
+    rasterizer->next = 0;
+    rasterizer->finished = 0;
+    ++rasterizer->generation;
+    // A single tile isn't worth waking anyone up for
+    if (rasterizer->tile_count > 1)
+        pthread_cond_broadcast(&rasterizer->work);
+    rasterizer_work(rasterizer, rasterizer->generation);
+    while (rasterizer->finished < rasterizer->tile_count)
+        pthread_cond_wait(&rasterizer->done, &rasterizer->mutex);
+    pthread_mutex_unlock(&rasterizer->mutex);
+    return bounds;
+}
+
+// Reads the whole canvas back into an image
+static Image raster_load_image(const RasterCanvas *canvas) {
+    Image image = alloc_image(canvas->width, canvas->height);
+    Color *dst = image.data;
+    for (int y = 0; y < canvas->height; ++y) {
+        for (int x = 0; x < canvas->width; ++x) {
+            const Color *tile = canvas->tiles[(y/TILE_SIZE)*canvas->tiles_x + x/TILE_SIZE];
+            dst[(size_t)y*canvas->width + x] = (tile != NULL) ? tile[(y%TILE_SIZE)*TILE_SIZE + x%TILE_SIZE]
+                                                              : canvas->background;
+        }
+    }
+    return image;
+}
+
+// Box filtered image of the canvas, at most `max_size` pixels on its longer
+// side
+static Image raster_thumbnail(const RasterCanvas *canvas, int max_size) {
+    const int factor = MAX(1, (MAX(canvas->width, canvas->height) + max_size - 1)/max_size);
+    const int width = MAX(1, canvas->width/factor);
+    const int height = MAX(1, canvas->height/factor);
+    Image image = alloc_image(width, height);
+    Color *dst = image.data;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            unsigned sum[4] = {0};
+            int n = 0;
+            for (int sy = y*factor; sy < MIN((y + 1)*factor, canvas->height); ++sy) {
+                for (int sx = x*factor; sx < MIN((x + 1)*factor, canvas->width); ++sx) {
+                    const Color *tile = canvas->tiles[(sy/TILE_SIZE)*canvas->tiles_x + sx/TILE_SIZE];
+                    const Color c = (tile != NULL) ? tile[(sy%TILE_SIZE)*TILE_SIZE + sx%TILE_SIZE] : canvas->background;
+                    sum[0] += c.r;
+                    sum[1] += c.g;
+                    sum[2] += c.b;
+                    sum[3] += c.a;
+                    ++n;
+                }
+            }
+            dst[y*width + x] = (Color){sum[0]/n, sum[1]/n, sum[2]/n, sum[3]/n};
+        }
+    }
+    return image;
+}
+
+#endif // BEAK_NO_MAIN
 
+#ifndef BEAK_NO_MAIN
 //
-// UndoLog: Storage for all previous images you can get to via
-//          undo/redo actions. We store one Image for each previous
-//          stage.
+// View: Everything a presented frame shows besides the canvas contents. When
+//       waiting for events, frames are only presented if this or the canvas
+//       changed.
 //
-// images: Array of `size` images describing undo states.
-// used_size: Number of images actually used.
-// top: Index of most recent image pushed (note this will wrap).
-// selected: Index of the currently selected image. Used to keep track of which
-//           entry is being viewed.
+typedef struct View {
+    float x, y;
+    float zoom;
+    int width, height;
+    Vector2 cursor;
+    float brush_radius;
+    Color brush_color;
+    bool focused;
+    bool overlay;
+    int layer;
+    uint32_t hidden;
+    Bounds selection;
+} View;
+
+static inline bool view_equal(View a, View b) {
+    return a.x == b.x && a.y == b.y && a.zoom == b.zoom &&
+           a.width == b.width && a.height == b.height &&
+           a.cursor.x == b.cursor.x && a.cursor.y == b.cursor.y &&
+           a.brush_radius == b.brush_radius &&
+           color_equal(a.brush_color, b.brush_color) &&
+           a.focused == b.focused && a.overlay == b.overlay &&
+           a.layer == b.layer && a.hidden == b.hidden &&
+           bounds_equal(a.selection, b.selection);
+}
+
+// Window region showing the canvas region `bounds`, padded by a pixel for
+// filtering
+static Bounds view_canvas_bounds(View view, Bounds bounds) {
+    if (bounds_is_empty(bounds))
+        return BOUNDS_EMPTY;
+    return (Bounds){
+        (int)floorf((bounds.x0 - view.x)*view.zoom) - 1,
+        (int)floorf((bounds.y0 - view.y)*view.zoom) - 1,
+        (int)ceilf((bounds.x1 - view.x)*view.zoom) + 1,
+        (int)ceilf((bounds.y1 - view.y)*view.zoom) + 1,
+    };
+}
+
+// Window region covered by the brush cursor
+static Bounds view_cursor_bounds(View view) {
+    const float radius = 1.2f*view.zoom*view.brush_radius + 2.0f;
+    return (Bounds){
+        (int)floorf(view.cursor.x - radius), (int)floorf(view.cursor.y - radius),
+        (int)ceilf(view.cursor.x + radius), (int)ceilf(view.cursor.y + radius),
+    };
+}
+
+// Region of the window that differs between the frames showing `presented`
+// and `view`, given the region of the canvas that changed in between. Moving
+// the view or changing what layers show changes everything.
+static Bounds view_damage(View view, View presented, Bounds canvas_changed) {
+    const Bounds window = {0, 0, view.width, view.height};
+    if (view.x != presented.x || view.y != presented.y || view.zoom != presented.zoom ||
+        view.width != presented.width || view.height != presented.height ||
+        view.layer != presented.layer || view.hidden != presented.hidden)
+        return window;
+
+    // Zoomed out, tiles are sampled from mipmaps of the whole tile, so a
+    // change anywhere in a tile can show anywhere in it
+    if (view.zoom < 1.0f && !bounds_is_empty(canvas_changed)) {
+        canvas_changed = (Bounds){MAX(canvas_changed.x0, 0)/TILE_SIZE*TILE_SIZE,
+                                  MAX(canvas_changed.y0, 0)/TILE_SIZE*TILE_SIZE,
+                                  (MAX(canvas_changed.x1 - 1, 0)/TILE_SIZE + 1)*TILE_SIZE,
+                                  (MAX(canvas_changed.y1 - 1, 0)/TILE_SIZE + 1)*TILE_SIZE};
+    }
+    Bounds damage = view_canvas_bounds(view, canvas_changed);
+    if (view.cursor.x != presented.cursor.x || view.cursor.y != presented.cursor.y ||
+        view.brush_radius != presented.brush_radius || !color_equal(view.brush_color, presented.brush_color)) {
+        damage = bounds_union(damage, view_cursor_bounds(view));
+        damage = bounds_union(damage, view_cursor_bounds(presented));
+    }
+    if (!bounds_equal(view.selection, presented.selection)) {
+        damage = bounds_union(damage, view_canvas_bounds(view, view.selection));
+        damage = bounds_union(damage, view_canvas_bounds(view, presented.selection));
+    }
+    return bounds_intersect(damage, window);
+}
+
+typedef enum StatsTimer {
+    STATS_INPUT,
+    STATS_UNDO,
+    STATS_STROKE,
+    STATS_DRAW,
+    STATS_PRESENT,
+    STATS_TIMER_COUNT,
+} StatsTimer;
+
+static const char *stats_timer_names[STATS_TIMER_COUNT] = {
+    [STATS_INPUT]   = "input",
+    [STATS_UNDO]    = "undo",
+    [STATS_STROKE]  = "stroke",
+    [STATS_DRAW]    = "draw",
+    [STATS_PRESENT] = "present",
+};
+
 //
-typedef struct UndoLog {
-    Image *images;
-    size_t size;
-    size_t used_size;
-    size_t top;
-    size_t selected;
-} UndoLog;
+// Stats: Timings of the main loop, shown by the overlay and logged per
+//        presented frame to an optional CSV file. Timers measure CPU time of
+//        the calls they wrap, GPU work shows up wherever the driver makes us
+//        wait for it, usually in present.
+//
+// started: GetTime() when each timer was last started.
+// times: Seconds spent in each timer since the last presented frame. Input
+//        wraps the whole input phase, so undo work is taken out of it.
+// average: Moving average of `times` over presented frames, in seconds.
+// last_frame: GetTime() when the last frame was presented.
+// frame_time, average_frame_time: Seconds between presented frames, idle
+//                                 time spent waiting for events included.
+// cpu_memory, gpu_memory: Bytes held by the undo history.
+// undo_entries: Number of changes held by the undo history, undone ones
+//               included.
+// csv: File frames are logged to, NULL if not logging.
+// frame: Number of presented frames.
+// overlay: Whether the overlay is shown.
+//
+typedef struct Stats {
+    double started[STATS_TIMER_COUNT];
+    double times[STATS_TIMER_COUNT];
+    double average[STATS_TIMER_COUNT];
+    double last_frame;
+    double frame_time, average_frame_time;
+    size_t cpu_memory, gpu_memory;
+    size_t undo_entries;
+    FILE *csv;
+    size_t frame;
+    bool overlay;
+} Stats;
 
-// Makes a GPU->CPU copy of framebuffer and pushes it onto the undo log
-static inline void undo_log_push(UndoLog *log, RenderTexture2D framebuffer) {
-    // If we're out of space we know the entry is already occupied
-    // so unload it first.
-    assert(log->used_size <= log->size);
-    if (log->used_size == log->size)
-        UnloadImage(log->images[log->top]);
+static bool stats_init(Stats *stats, const char *csv_path) {
+    *stats = (Stats){.last_frame = GetTime()};
+    if (csv_path[0] == '\0')
+        return true;
 
-    // Copy texture to log
-    log->images[log->top] = LoadImageFromTexture(framebuffer.texture);
+    stats->csv = fopen(csv_path, "w");
+    if (stats->csv == NULL) {
+        fprintf(stderr, "[error]: Failed to open stats log '%s'\n", csv_path);
+        return false;
+    }
+    fprintf(stats->csv, "frame,time");
+    for (int i = 0; i < STATS_TIMER_COUNT; ++i)
+        fprintf(stats->csv, ",%s_ms", stats_timer_names[i]);
+    fprintf(stats->csv, ",frame_ms,undo_cpu_bytes,undo_gpu_bytes,undo_entries\n");
+    return true;
+}
 
-    // Update indices/used_size
-    log->selected = log->top;
-    log->top = (log->top + 1) % log->size;
-    if (log->used_size < log->size)
-        ++log->used_size;
+static inline void stats_start(Stats *stats, StatsTimer timer) {
+    stats->started[timer] = GetTime();
+}
+
+static inline void stats_stop(Stats *stats, StatsTimer timer) {
+    stats->times[timer] += GetTime() - stats->started[timer];
 }
 
-// Makes a CPU->GPU copy of log entry to framebuffer
-static inline void undo_log_copy(UndoLog *log, RenderTexture2D framebuffer, int offset) {
-    // Select the log entry at the requested offset
-    log->selected = (log->selected + log->size + offset) % log->size;
+// Ends the frame after it was presented
+static void stats_end_frame(Stats *stats, size_t cpu_memory, size_t gpu_memory, size_t undo_entries) {
+    const double now = GetTime();
+    stats->times[STATS_INPUT] = MAX(0.0, stats->times[STATS_INPUT] - stats->times[STATS_UNDO]);
+    stats->frame_time = now - stats->last_frame;
+    stats->last_frame = now;
+    stats->cpu_memory = cpu_memory;
+    stats->gpu_memory = gpu_memory;
+    stats->undo_entries = undo_entries;
 
-    // Load the image to a texture and draw it to the framebuffer
-    Texture2D texture = LoadTextureFromImage(log->images[log->selected]);
-    BeginTextureMode(framebuffer);
-    // Negate the height of the texture to flip it vertically
-    DrawTextureRec(texture, (Rectangle){0, 0, texture.width, -texture.height}, (Vector2){0, 0}, WHITE);
-    EndTextureMode();
+    const double alpha = (stats->frame == 0) ? 1.0 : 0.05;
+    for (int i = 0; i < STATS_TIMER_COUNT; ++i)
+        stats->average[i] += alpha*(stats->times[i] - stats->average[i]);
+    stats->average_frame_time += alpha*(stats->frame_time - stats->average_frame_time);
+
+    if (stats->csv != NULL) {
+        fprintf(stats->csv, "%zu,%.6f", stats->frame, now);
+        for (int i = 0; i < STATS_TIMER_COUNT; ++i)
+            fprintf(stats->csv, ",%.3f", 1000.0*stats->times[i]);
+        fprintf(stats->csv, ",%.3f,%zu,%zu,%zu\n", 1000.0*stats->frame_time, cpu_memory, gpu_memory, undo_entries);
+    }
 
-    UnloadTexture(texture);
+    for (int i = 0; i < STATS_TIMER_COUNT; ++i)
+        stats->times[i] = 0.0;
+    ++stats->frame;
 }
 
-// Mapping ints to linearly spaced HSV colors
-static inline Color get_brush_color(int i) {
-    return ColorFromHSV(fmodf(360.0f * ((float)i/(float)NUM_COLORS), 360.0f), 0.75f, 0.75f);
+#define STATS_FONT_SIZE 10
+#define STATS_LINE (STATS_FONT_SIZE + 2)
+
+// Window region covered by the overlay
+static inline Bounds stats_bounds(void) {
+    return (Bounds){4, 4, 4 + 180, 4 + (STATS_TIMER_COUNT + 4)*STATS_LINE + 8};
 }
 
-// Clear framebuffer to color and then push new state to undo log
-static void clear_framebuffer(UndoLog *log, RenderTexture2D framebuffer, Color color) {
-    BeginTextureMode(framebuffer);
-    ClearBackground(color);
-    EndTextureMode();
-    undo_log_push(log, framebuffer);
+static void stats_draw(const Stats *stats) {
+    if (!stats->overlay)
+        return;
+    const int font_size = STATS_FONT_SIZE;
+    const int line = STATS_LINE;
+    const Bounds b = stats_bounds();
+    DrawRectangle(b.x0, b.y0, b.x1 - b.x0, b.y1 - b.y0, Fade(BLACK, 0.75f));
+
+    int y = 8;
+    DrawText(TextFormat("frame   %6.2f ms", 1000.0*stats->average_frame_time), 8, y, font_size, WHITE);
+    y += line;
+    for (int i = 0; i < STATS_TIMER_COUNT; ++i) {
+        DrawText(TextFormat("%-7s %6.2f ms", stats_timer_names[i], 1000.0*stats->average[i]), 8, y, font_size, WHITE);
+        y += line;
+    }
+    DrawText(TextFormat("undo    %6.1f MiB CPU", stats->cpu_memory/(1024.0*1024.0)), 8, y, font_size, WHITE);
+    y += line;
+    DrawText(TextFormat("        %6.1f MiB GPU", stats->gpu_memory/(1024.0*1024.0)), 8, y, font_size, WHITE);
+    y += line;
+    DrawText(TextFormat("        %6zu entries", stats->undo_entries), 8, y, font_size, WHITE);
+}
+
+static void stats_close(Stats *stats) {
+    if (stats->csv != NULL)
+        fclose(stats->csv);
+    stats->csv = NULL;
+}
+
+// Keys the main loop checks, in the order of their bits in Input
+static const int input_keys[] = {
+    KEY_Q, KEY_W, KEY_C, KEY_S, KEY_P, KEY_F, KEY_L, KEY_H, KEY_F3, KEY_LEFT_CONTROL, KEY_RIGHT_CONTROL,
+    KEY_LEFT_SHIFT, KEY_RIGHT_SHIFT, KEY_V, KEY_X,
+};
+
+//
+// TabletSample: Pen position and pressure. Tablets report positions as
+//               fractions of their area, Input has them in window
+//               coordinates.
+//
+typedef struct TabletSample {
+    float x, y;
+    float pressure;
+} TabletSample;
+
+//
+// Tablet: Reads a pen tablet's evdev device on its own thread, so samples
+//         arrive at the device's rate instead of once per frame. Samples are
+//         queued while the pen touches the tablet, with pressure smoothed to
+//         hide sensor jitter.
+//
+// fd: The device, -1 without a tablet.
+// thread: Reader thread.
+// mutex: Protects samples, sample_count and quit.
+// samples: Samples since the last frame, oldest first.
+// sample_count: Number of queued samples.
+// quit: Tells the reader thread to exit.
+// min, max: Range of the x, y and pressure axes.
+//
+typedef struct Tablet {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    TabletSample samples[MAX_TABLET_SAMPLES];
+    int sample_count;
+    bool quit;
+    int min[3], max[3];
+} Tablet;
+
+#ifdef __linux__
+static inline float tablet_axis(const Tablet *tablet, int axis, int value) {
+    return (tablet->max[axis] > tablet->min[axis]) ?
+           (float)(value - tablet->min[axis])/(tablet->max[axis] - tablet->min[axis]) : 1.0f;
+}
+
+static void *tablet_main(void *arg) {
+    Tablet *tablet = arg;
+    int value[3] = {0, 0, tablet->max[2]};
+    bool touching = false;
+    float pressure = 0.0f;
+    for (;;) {
+        pthread_mutex_lock(&tablet->mutex);
+        const bool quit = tablet->quit;
+        pthread_mutex_unlock(&tablet->mutex);
+        if (quit)
+            break;
+
+        // Wake up now and then to notice quit
+        struct pollfd pfd = {.fd = tablet->fd, .events = POLLIN};
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        struct input_event events[64];
+        const ssize_t n = read(tablet->fd, events, sizeof(events));
+        if (n <= 0) {
+            fprintf(stderr, "[warning]: Lost the tablet, falling back to the mouse\n");
+            break;
+        }
+
+        for (size_t i = 0; i < n/sizeof(events[0]); ++i) {
+            const struct input_event *event = &events[i];
+            if (event->type == EV_ABS && event->code == ABS_X) {
+                value[0] = event->value;
+            } else if (event->type == EV_ABS && event->code == ABS_Y) {
+                value[1] = event->value;
+            } else if (event->type == EV_ABS && event->code == ABS_PRESSURE) {
+                value[2] = event->value;
+            } else if (event->type == EV_KEY && event->code == BTN_TOUCH) {
+                touching = event->value != 0;
+                // Start every stroke from its own pressure
+                pressure = tablet_axis(tablet, 2, value[2]);
+            } else if (event->type == EV_SYN && event->code == SYN_REPORT && touching) {
+                pressure += 0.5f*(tablet_axis(tablet, 2, value[2]) - pressure);
+                const TabletSample sample = {
+                    tablet_axis(tablet, 0, value[0]),
+                    tablet_axis(tablet, 1, value[1]),
+                    CLAMP(0.0f, pressure, 1.0f),
+                };
+                pthread_mutex_lock(&tablet->mutex);
+                if (tablet->sample_count < MAX_TABLET_SAMPLES)
+                    ++tablet->sample_count;
+                tablet->samples[tablet->sample_count - 1] = sample;
+                pthread_mutex_unlock(&tablet->mutex);
+            }
+        }
+    }
+    return NULL;
+}
+#endif
+
+static bool tablet_open(Tablet *tablet, const char *path) {
+    *tablet = (Tablet){.fd = -1};
+#ifdef __linux__
+    tablet->fd = open(path, O_RDONLY);
+    if (tablet->fd < 0) {
+        fprintf(stderr, "[error]: Failed to open tablet '%s'\n", path);
+        return false;
+    }
+    static const int axes[] = {ABS_X, ABS_Y, ABS_PRESSURE};
+    for (int i = 0; i < 3; ++i) {
+        struct input_absinfo info;
+        if (ioctl(tablet->fd, EVIOCGABS(axes[i]), &info) < 0) {
+            // Without a pressure axis every sample is at full pressure
+            if (i < 2) {
+                fprintf(stderr, "[error]: '%s' is not an absolute pointing device\n", path);
+                close(tablet->fd);
+                tablet->fd = -1;
+                return false;
+            }
+            continue;
+        }
+        tablet->min[i] = info.minimum;
+        tablet->max[i] = info.maximum;
+    }
+    pthread_mutex_init(&tablet->mutex, NULL);
+    if (pthread_create(&tablet->thread, NULL, tablet_main, tablet) != 0) {
+        fprintf(stderr, "[error]: Failed to start tablet thread\n");
+        pthread_mutex_destroy(&tablet->mutex);
+        close(tablet->fd);
+        tablet->fd = -1;
+        return false;
+    }
+    return true;
+#else
+    fprintf(stderr, "[error]: Tablets are only supported on Linux, '%s' ignored\n", path);
+    return false;
+#endif
+}
+
+// Moves the queued samples to `samples`, returns how many there were
+static int tablet_drain(Tablet *tablet, TabletSample *samples) {
+    if (tablet->fd < 0)
+        return 0;
+    pthread_mutex_lock(&tablet->mutex);
+    const int count = tablet->sample_count;
+    memcpy(samples, tablet->samples, count*sizeof(TabletSample));
+    tablet->sample_count = 0;
+    pthread_mutex_unlock(&tablet->mutex);
+    return count;
+}
+
+static void tablet_close(Tablet *tablet) {
+    if (tablet->fd < 0)
+        return;
+    pthread_mutex_lock(&tablet->mutex);
+    tablet->quit = true;
+    pthread_mutex_unlock(&tablet->mutex);
+    pthread_join(tablet->thread, NULL);
+    pthread_mutex_destroy(&tablet->mutex);
+    close(tablet->fd);
+    tablet->fd = -1;
+}
+
+//
+// Input: Everything the main loop reads from the window in one frame. The
+//        loop only looks at this, so sessions can be recorded and replayed
+//        frame by frame.
+//
+// width, height: Size of the window.
+// mouse: Mouse position in the window.
+// wheel: Mouse wheel movement.
+// key: Key returned by GetKeyPressed().
+// buttons_down, buttons_pressed, buttons_released: Bit per mouse button.
+// keys_down, keys_pressed: Bit per key in `input_keys`.
+// focused: Whether the window has focus.
+// quit: Whether the window should close.
+// samples, sample_count: Tablet samples since the last frame, in window
+//                        coordinates.
+//
+typedef struct Input {
+    int32_t width, height;
+    Vector2 mouse;
+    float wheel;
+    int32_t key;
+    uint32_t buttons_down, buttons_pressed, buttons_released;
+    uint32_t keys_down, keys_pressed;
+    uint8_t focused;
+    uint8_t quit;
+    int32_t sample_count;
+    TabletSample samples[MAX_TABLET_SAMPLES];
+} Input;
+
+#define RECORDING_MAGIC "beakrec2"
+
+// Recordings start with this followed by one Input per frame, in host byte
+// order. Replaying needs the same options, so the canvas size is kept to
+// catch the most likely mistake.
+typedef struct RecordingHeader {
+    char magic[8];
+    uint32_t canvas_width, canvas_height;
+} RecordingHeader;
+
+static Input input_poll(Tablet *tablet) {
+    Input input = {
+        .width = GetScreenWidth(),
+        .height = GetScreenHeight(),
+        .mouse = GetMousePosition(),
+        .wheel = GetMouseWheelMove(),
+        .key = GetKeyPressed(),
+        .focused = IsWindowFocused(),
+        .quit = WindowShouldClose(),
+    };
+    for (int button = MOUSE_BUTTON_LEFT; button <= MOUSE_BUTTON_BACK; ++button) {
+        input.buttons_down |= IsMouseButtonDown(button) << button;
+        input.buttons_pressed |= IsMouseButtonPressed(button) << button;
+        input.buttons_released |= IsMouseButtonReleased(button) << button;
+    }
+    for (unsigned i = 0; i < ARRLEN(input_keys); ++i) {
+        input.keys_down |= IsKeyDown(input_keys[i]) << i;
+        input.keys_pressed |= IsKeyPressed(input_keys[i]) << i;
+    }
+
+    // Tablets cover the monitor the window is on
+    input.sample_count = tablet_drain(tablet, input.samples);
+    const int monitor = GetCurrentMonitor();
+    const Vector2 monitor_pos = GetMonitorPosition(monitor);
+    const Vector2 window_pos = GetWindowPosition();
+    for (int i = 0; i < input.sample_count; ++i) {
+        input.samples[i].x = monitor_pos.x + input.samples[i].x*GetMonitorWidth(monitor) - window_pos.x;
+        input.samples[i].y = monitor_pos.y + input.samples[i].y*GetMonitorHeight(monitor) - window_pos.y;
+    }
+    return input;
+}
+
+static inline uint32_t input_key_bit(int key) {
+    for (unsigned i = 0; i < ARRLEN(input_keys); ++i)
+        if (input_keys[i] == key)
+            return 1u << i;
+    assert(!"key missing from input_keys");
+    return 0;
+}
+
+static inline bool input_key_down(const Input *input, int key) {
+    return input->keys_down & input_key_bit(key);
+}
+
+static inline bool input_key_pressed(const Input *input, int key) {
+    return input->keys_pressed & input_key_bit(key);
+}
+
+static inline bool input_button_down(const Input *input, int button) {
+    return input->buttons_down & (1u << button);
+}
+
+static inline bool input_button_pressed(const Input *input, int button) {
+    return input->buttons_pressed & (1u << button);
+}
+
+static inline bool input_button_released(const Input *input, int button) {
+    return input->buttons_released & (1u << button);
+}
+
+static FILE *recording_open(const char *path, bool replay, int canvas_width, int canvas_height) {
+    FILE *file = fopen(path, replay ? "rb" : "wb");
+    if (file == NULL) {
+        fprintf(stderr, "[error]: Failed to open recording '%s'\n", path);
+        return NULL;
+    }
+
+    RecordingHeader header = {.canvas_width = canvas_width, .canvas_height = canvas_height};
+    memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+    if (!replay) {
+        fwrite(&header, sizeof(header), 1, file);
+        return file;
+    }
+
+    RecordingHeader recorded;
+    if (fread(&recorded, sizeof(recorded), 1, file) != 1 ||
+        memcmp(recorded.magic, RECORDING_MAGIC, sizeof(recorded.magic)) != 0) {
+        fprintf(stderr, "[error]: '%s' is not a beak recording\n", path);
+        fclose(file);
+        return NULL;
+    }
+    if (recorded.canvas_width != header.canvas_width || recorded.canvas_height != header.canvas_height)
+        fprintf(stderr, "[warning]: '%s' was recorded on a %ux%u canvas, replay will differ\n",
+                path, recorded.canvas_width, recorded.canvas_height);
+    return file;
+}
+
+// Reads the next frame of a replay, the replay quits once it runs out
+static Input input_replay(FILE *file) {
+    Input input;
+    if (fread(&input, sizeof(input), 1, file) != 1)
+        return (Input){.quit = true};
+    // Keep the window in step with the recording, closing it still quits
+    if (input.width != GetScreenWidth() || input.height != GetScreenHeight())
+        SetWindowSize(input.width, input.height);
+    input.quit |= WindowShouldClose();
+    return input;
 }
 
 typedef enum CmdLineOptionType {
@@ -102,25 +5490,79 @@ typedef struct CmdLineOption {
         unsigned long *ulong;
     };
     unsigned int base;
+    bool given;
 } CmdLineOption;
 
+// Whether option `name` was on the commandline rather than left at its
+// default
+static bool cmdline_option_given(const CmdLineOption *options, size_t count, const char *name) {
+    for (size_t i = 0; i < count; ++i)
+        if (strcmp(options[i].name, name) == 0)
+            return options[i].given;
+    return false;
+}
+
 int main(int argc, char **argv) {
     unsigned long canvas_width  = 2560;
     unsigned long canvas_height = 1440;
     unsigned long window_width  = 800;
     unsigned long window_height = 600;
     unsigned long undo_log_size = 16;
+    unsigned long undo_memory_budget = 0;
+    unsigned long undo_vram_budget = 0;
+    unsigned long undo_pool = 64;
     unsigned long background_hexcolor = 0x111600FF;
+    unsigned long wait_events = 1;
+    unsigned long partial_redraw = 1;
+    unsigned long vector_undo = 0;
+    unsigned long layer_count = 1;
+    unsigned long fill_tolerance = 32;
+    unsigned long smooth_strokes = 1;
+    unsigned long keyframe_budget = 256;
+    unsigned long autosave_interval = 10;
+    unsigned long save_compression = 6;
+    unsigned long save_crop = 0;
     const char *save_path = "beak.png";
+    const char *autosave_path = "beak.journal";
+    const char *project_path = "beak.beak";
+    const char *stats_path = "";
+    const char *record_path = "";
+    const char *replay_path = "";
+    const char *tablet_path = "";
+    const char *host_port = "";
+    const char *join_address = "";
+    const char *palette_spec = "";
 
     CmdLineOption options[] = {
-        {"--canvas-width",  "ulong",               CMDLINE_OPTION_ULONG, .ulong = &canvas_width},
-        {"--canvas-height", "ulong",               CMDLINE_OPTION_ULONG, .ulong = &canvas_height},
-        {"--window-width",  "ulong",               CMDLINE_OPTION_ULONG, .ulong = &window_width},
-        {"--window-height", "ulong",               CMDLINE_OPTION_ULONG, .ulong = &window_height},
-        {"--undo-log-size", "ulong",               CMDLINE_OPTION_ULONG, .ulong = &undo_log_size},
-        {"--background",    "0xRRGGBBAA",          CMDLINE_OPTION_HEX,   .ulong = &background_hexcolor},
-        {"--save-path",     "/save/path/file.png", CMDLINE_OPTION_STR,   .str   = &save_path},
+        {"--canvas-width",     "ulong",               CMDLINE_OPTION_ULONG, .ulong = &canvas_width},
+        {"--canvas-height",    "ulong",               CMDLINE_OPTION_ULONG, .ulong = &canvas_height},
+        {"--window-width",     "ulong",               CMDLINE_OPTION_ULONG, .ulong = &window_width},
+        {"--window-height",    "ulong",               CMDLINE_OPTION_ULONG, .ulong = &window_height},
+        {"--undo-log-size",    "ulong",               CMDLINE_OPTION_ULONG, .ulong = &undo_log_size},
+        {"--undo-memory-budget", "MiB (0 = off)",     CMDLINE_OPTION_ULONG, .ulong = &undo_memory_budget},
+        {"--undo-vram-budget", "MiB (0 = CPU undo)",  CMDLINE_OPTION_ULONG, .ulong = &undo_vram_budget},
+        {"--undo-pool",        "MiB",                 CMDLINE_OPTION_ULONG, .ulong = &undo_pool},
+        {"--vector-undo",      "strokes/keyframe",    CMDLINE_OPTION_ULONG, .ulong = &vector_undo},
+        {"--layers",           "ulong",               CMDLINE_OPTION_ULONG, .ulong = &layer_count},
+        {"--fill-tolerance",   "0-255",               CMDLINE_OPTION_ULONG, .ulong = &fill_tolerance},
+        {"--smooth-strokes",   "0/1",                 CMDLINE_OPTION_ULONG, .ulong = &smooth_strokes},
+        {"--keyframe-budget",  "MiB",                 CMDLINE_OPTION_ULONG, .ulong = &keyframe_budget},
+        {"--background",       "0xRRGGBBAA",          CMDLINE_OPTION_HEX,   .ulong = &background_hexcolor},
+        {"--wait-events",      "0/1",                 CMDLINE_OPTION_ULONG, .ulong = &wait_events},
+        {"--partial-redraw",   "0/1",                 CMDLINE_OPTION_ULONG, .ulong = &partial_redraw},
+        {"--save-path",        "/save/path/file.png", CMDLINE_OPTION_STR,   .str   = &save_path},
+        {"--save-compression", "0-9 (fast-small)",    CMDLINE_OPTION_ULONG, .ulong = &save_compression},
+        {"--save-crop",        "0/1",                 CMDLINE_OPTION_ULONG, .ulong = &save_crop},
+        {"--autosave-interval", "seconds (0 = off)",  CMDLINE_OPTION_ULONG, .ulong = &autosave_interval},
+        {"--autosave-path",    "/path/file.journal",  CMDLINE_OPTION_STR,   .str   = &autosave_path},
+        {"--project",          "/path/file.beak",     CMDLINE_OPTION_STR,   .str   = &project_path},
+        {"--stats-csv",        "/path/file.csv",      CMDLINE_OPTION_STR,   .str   = &stats_path},
+        {"--record",           "/path/file.rec",      CMDLINE_OPTION_STR,   .str   = &record_path},
+        {"--replay",           "/path/file.rec",      CMDLINE_OPTION_STR,   .str   = &replay_path},
+        {"--tablet",           "/dev/input/eventN",   CMDLINE_OPTION_STR,   .str   = &tablet_path},
+        {"--host",             "port",                CMDLINE_OPTION_STR,   .str   = &host_port},
+        {"--join",             "host:port",           CMDLINE_OPTION_STR,   .str   = &join_address},
+        {"--palette",          "count or /path/file", CMDLINE_OPTION_STR,   .str   = &palette_spec},
     };
 
     //
@@ -130,9 +5572,9 @@ int main(int argc, char **argv) {
         const char *option = argv[i];
         if (strncmp(option, "--help", 6) == 0) {
             puts("beak [options]\n");
-            printf("%-16s%-24s%-16s\n", "option", "format", "default");
+            printf("%-22s%-24s%-16s\n", "option", "format", "default");
             for (unsigned i = 0; i < ARRLEN(options); ++i) {
-                printf("%-16s%-24s", options[i].name, options[i].format);
+                printf("%-22s%-24s", options[i].name, options[i].format);
                 switch (options[i].type) {
                 case CMDLINE_OPTION_STR:
                     printf("%-16s", *options[i].str);
@@ -148,15 +5590,28 @@ int main(int argc, char **argv) {
             }
             putchar('\n');
             puts("keybinds:");
-            puts("1-5           Use n:th color");
+            puts("1-9, 0        Use n:th color");
+            puts("[, ]          Use previous/next color");
             puts("q, mouse 4    Undo");
             puts("w, mouse 5    Redo");
             puts("c             Clear");
-            puts("s             Save image to --save-path");
+            puts("s             Save image to --save-path, PNG or any format raylib exports");
+            puts("p             Save project to --project");
+            puts("f             Fill the area under the cursor");
+            puts("l             Select next layer");
+            puts("h             Show/hide selected layer");
+            puts("f3            Toggle frame time overlay");
             puts("mouse wheel   Change brush size");
+            puts("ctrl+wheel    Zoom");
             puts("mouse 1       Paint");
             puts("mouse 2       Erase");
             puts("mouse 3       Pan");
+            puts("shift+mouse 1 Select, drag the selection to move it");
+            puts("+ctrl         Drag a copy of the selection");
+            puts("ctrl+c/x/v    Copy/cut/paste the selection");
+            putchar('\n');
+            puts("--partial-redraw only redraws what changed. Under GLX with GLX_EXT_buffer_age");
+            puts("only that is copied to the window too, otherwise every frame copies all of it.");
             return 0;
         }
 
@@ -170,6 +5625,7 @@ int main(int argc, char **argv) {
         for (unsigned i = 0; i < ARRLEN(options); ++i) {
             if (strcmp(option, options[i].name) != 0)
                 continue;
+            options[i].given = true;
             switch (options[i].type) {
             case CMDLINE_OPTION_STR:
                 *options[i].str = value;
@@ -192,55 +5648,387 @@ int main(int argc, char **argv) {
         }
     }
 
+    // Stroke history has a budget of its own
+    if (undo_memory_budget > 0 && vector_undo > 0)
+        fprintf(stderr, "[warning]: --undo-memory-budget doesn't apply to --vector-undo, see --keyframe-budget\n");
+
+    if (save_compression > 9) {
+        fprintf(stderr, "[error]: --save-compression must be between 0 and 9\n");
+        return -1;
+    }
+
+    if (layer_count < 1 || layer_count > MAX_LAYERS) {
+        fprintf(stderr, "[error]: --layers must be between 1 and %d\n", MAX_LAYERS);
+        return -1;
+    }
+    // Stroke history replays onto a single canvas
+    if (layer_count > 1 && vector_undo > 0) {
+        fprintf(stderr, "[error]: --vector-undo only works with a single layer\n");
+        return -1;
+    }
+
+    // Stroke history only knows about local strokes
+    const bool hosting = host_port[0] != '\0';
+    const bool joining = join_address[0] != '\0';
+    if ((hosting || joining) && vector_undo > 0) {
+        fprintf(stderr, "[error]: --vector-undo doesn't work in shared sessions\n");
+        return -1;
+    }
+    if (hosting && joining) {
+        fprintf(stderr, "[error]: --host and --join are exclusive\n");
+        return -1;
+    }
+
+    // Joining takes the canvas from the host, so there's no project to open
+    // and nothing to recover
+    Net net;
+    net_init(&net);
+    NetHello hello;
+    if (joining) {
+        if (!net_join(&net, join_address, &hello))
+            return -1;
+        canvas_width = hello.width;
+        canvas_height = hello.height;
+        layer_count = hello.layer_count;
+        autosave_interval = 0;
+    }
+
+    // A project is only opened when asked for with --project, p saves to
+    // the default path otherwise. An existing one decides the canvas size,
+    // its tiles are only uploaded once they're needed.
+    Project project = {0};
+    const bool project_opened = !joining && cmdline_option_given(options, ARRLEN(options), "--project") &&
+                                project_map(&project, project_path);
+    if (project_opened) {
+        if ((cmdline_option_given(options, ARRLEN(options), "--canvas-width") ||
+             cmdline_option_given(options, ARRLEN(options), "--canvas-height")) &&
+            (canvas_width != project.header.width || canvas_height != project.header.height))
+            fprintf(stderr, "[warning]: Project '%s' is %ux%u, ignoring --canvas-width/--canvas-height\n",
+                    project_path, project.header.width, project.header.height);
+        canvas_width = project.header.width;
+        canvas_height = project.header.height;
+    }
+
+    FILE *record = NULL;
+    FILE *replay = NULL;
+    if (replay_path[0] != '\0') {
+        replay = recording_open(replay_path, true, canvas_width, canvas_height);
+        if (replay == NULL)
+            return -1;
+        // Replays run frame by frame, there are no events to wait for
+        wait_events = 0;
+    }
+    if (record_path[0] != '\0') {
+        record = recording_open(record_path, false, canvas_width, canvas_height);
+        if (record == NULL)
+            return -1;
+    }
+
+    // Replays carry the recorded tablet samples
+    Tablet tablet = {.fd = -1};
+    if (tablet_path[0] != '\0' && replay == NULL && !tablet_open(&tablet, tablet_path))
+        return -1;
+
     SetTraceLogLevel(LOG_ERROR);
     SetConfigFlags(FLAG_VSYNC_HINT | FLAG_WINDOW_RESIZABLE);
     InitWindow(window_width, window_height, "floating");
     HideCursor();
 
-    UndoLog log = {
-        .images = malloc(undo_log_size * sizeof(Image)),
-        .size = undo_log_size,
-    };
+    // Block in EndDrawing()/PollInputEvents() until there is input instead
+    // of running at vsync when idle. Peers' strokes don't wake us up.
+    if (hosting || joining)
+        wait_events = 0;
+    if (wait_events)
+        EnableEventWaiting();
 
-    RenderTexture2D framebuffer = LoadRenderTexture(canvas_width, canvas_height);
+    Stats stats;
+    stats_init(&stats, stats_path);
 
     Color background = GetColor(background_hexcolor);
+    if (project_opened) {
+        if (cmdline_option_given(options, ARRLEN(options), "--background") &&
+            !color_equal(background, project.header.background))
+            fprintf(stderr, "[warning]: Project '%s' has a background of its own, ignoring --background\n",
+                    project_path);
+        background = project.header.background;
+    }
+    if (joining)
+        background = hello.background;
+
+    // A given --palette replaces the one saved in the project, peers always
+    // use the host's
+    Palette palette;
+    palette_generate(&palette, 5);
+    if (project_opened)
+        palette = project.header.palette;
+    if (palette_spec[0] != '\0' && !palette_load(&palette, palette_spec))
+        return -1;
+    if (joining)
+        palette = hello.palette;
+
+    // Projects, the journal and stroke history only hold the bottom layer
+    Layers layers;
+    layers_init(&layers, layer_count, canvas_width, canvas_height, background);
+    Canvas *canvas = &layers.canvases[0];
+    if (layer_count > 1 && (project_opened || autosave_interval > 0))
+        fprintf(stderr, "[warning]: Only the bottom layer is saved to projects and autosaved\n");
+
+    Brush brush;
+    brush_load(&brush);
+
+    // Every layer has its own undo log
+    UndoLog logs[MAX_LAYERS];
+    for (int i = 0; i < layers.count; ++i)
+        undo_log_init(&logs[i], &layers.canvases[i], undo_log_size, undo_vram_budget << 20, undo_pool << 20);
+    UndoLog *log = &logs[0];
 
-    clear_framebuffer(&log, framebuffer, background);
+    Exporter exporter = {.level = save_compression, .crop = save_crop != 0};
+    exporter_start(&exporter);
+
+    // The first entry is the blank canvas
+    for (int i = 0; i < layers.count; ++i)
+        undo_log_clear(&logs[i]);
+    if (project_opened && vector_undo == 0)
+        project_load_history(&project, log);
+
+    // The journal is removed on exit, so if there is one we crashed and
+    // recover from it. Recovery is undoable like any other change.
+    Journal journal = {0};
+    if (autosave_interval > 0) {
+        // Recovered tiles would be overwritten by pending project tiles
+        if (FileExists(autosave_path))
+            project_stream(&project, log, canvas_bounds(canvas));
+        const Bounds recovered = journal_recover(autosave_path, canvas);
+        if (!bounds_is_empty(recovered)) {
+            fprintf(stderr, "[warning]: Recovered canvas from '%s'\n", autosave_path);
+            if (vector_undo == 0)
+                undo_log_push(log, recovered);
+        }
+        journal_open(&journal, canvas, autosave_path, recovered);
+    }
+
+    // Stroke history replaces the undo log if enabled. Keyframes need the
+    // whole canvas, so it is all uploaded from the project right away.
+    History history = {0};
+    if (vector_undo > 0) {
+        project_stream(&project, log, canvas_bounds(canvas));
+        history_init(&history, canvas, &brush, vector_undo, keyframe_budget << 20);
+    }
+
+    // Snapshots for joining peers need the whole canvas as well
+    if (hosting) {
+        project_stream(&project, log, canvas_bounds(canvas));
+        if (!net_host(&net, host_port, &palette))
+            return -1;
+    }
 
-    int target_x = window_width/2;
-    int target_y = window_height/2;
+    // Canvas point at the center of the window, and how much it's scaled
+    float target_x = window_width/2;
+    float target_y = window_height/2;
+    float zoom = 1.0f;
 
     float brush_radius = 10.0f;
+    // Pen pressure of the last tablet sample, the mouse draws at full size
+    float pressure = 1.0f;
 
     Vector2 prev_mouse_pos = {0};
     Vector2 mouse_pos = {0};
 
-    Color brush_color = get_brush_color(0);
-    while (!WindowShouldClose()) {
-        const int w = GetScreenWidth();
-        const int h = GetScreenHeight();
+    // Samples of the current stroke not yet drawn, the color it's drawn
+    // with and the region of the canvas touched by it
+    StrokeBuffer stroke = {.smooth = smooth_strokes != 0};
+    Color stroke_color = BLANK;
+    Bounds stroke_bounds = BOUNDS_EMPTY;
+
+    Selection selection = {.bounds = BOUNDS_EMPTY};
+
+    // What the last presented frame showed, the first frame is always
+    // presented
+    View presented = {.width = -1};
+    // The last presented frame. The back buffer is undefined after a swap,
+    // so frames are drawn here, where only the region that changed needs to
+    // be redrawn, and then copied to the window. Where the driver reports
+    // the age of the back buffer, only what changed since it was presented
+    // is copied, see `recent`.
+    RenderTexture2D frame = {0};
+    const bool use_buffer_age = partial_redraw && buffer_age_supported();
+    // Damage of the last presented frames, newest first
+    Bounds recent[MAX_BUFFER_AGE - 1];
+    int recent_count = 0;
+
+    uint32_t brush_index = 0;
+    for (;;) {
+        // Everything below reads the window through this, so replays go
+        // through exactly the same code
+        const Input input = (replay != NULL) ? input_replay(replay) : input_poll(&tablet);
+        if (record != NULL)
+            fwrite(&input, sizeof(input), 1, record);
+        if (input.quit)
+            break;
+
+        const int w = input.width;
+        const int h = input.height;
+
+        // Region of the canvas whose contents changed this frame
+        Bounds canvas_changed = BOUNDS_EMPTY;
+
+        stats_start(&stats, STATS_INPUT);
+
+        // Pick up undo entries whose readback finished since last frame
+        stats_start(&stats, STATS_UNDO);
+        for (int i = 0; i < layers.count; ++i) {
+            undo_log_poll(&logs[i]);
+            undo_log_reclaim(&logs[i]);
+            // Layers share the budget evenly
+            if (undo_memory_budget > 0 && vector_undo == 0)
+                undo_log_trim(&logs[i], (undo_memory_budget << 20)/layers.count);
+        }
+        stats_stop(&stats, STATS_UNDO);
+
+        if (input_key_pressed(&input, KEY_F3))
+            stats.overlay = !stats.overlay;
+
+        // Strokes, clears and undo go to the selected layer. Finish the
+        // stroke on the old layer before switching.
+        if (input_key_pressed(&input, KEY_L) && stroke.count == 0 && selection.drag == SELECTION_NONE) {
+            layers.active = (layers.active + 1) % layers.count;
+            canvas_changed = canvas_bounds(canvas);
+        }
+        if (input_key_pressed(&input, KEY_H) && layers.count > 1) {
+            layers_toggle(&layers, layers.active);
+            canvas_changed = canvas_bounds(canvas);
+        }
+        UndoLog *layer_log = &logs[layers.active];
+        Canvas *layer_canvas = layer_log->canvas;
 
         // Handle chaning of brush color
-        const int key = GetKeyPressed();
-        if (key >= KEY_ONE && key <= KEY_FIVE)
-            brush_color = get_brush_color(key - KEY_ONE);
+        const int key = input.key;
+        if (key >= KEY_ONE && key <= KEY_NINE && (uint32_t)(key - KEY_ONE) < palette.count)
+            brush_index = key - KEY_ONE;
+        if (key == KEY_ZERO && palette.count >= 10)
+            brush_index = 9;
+        if (key == KEY_LEFT_BRACKET)
+            brush_index = (brush_index + palette.count - 1) % palette.count;
+        if (key == KEY_RIGHT_BRACKET)
+            brush_index = (brush_index + 1) % palette.count;
+        const Color brush_color = palette.colors[brush_index];
 
-        const float scroll = GetMouseWheelMove();
-        if (scroll != 0.0f) {
+        const bool ctrl = input_key_down(&input, KEY_LEFT_CONTROL) || input_key_down(&input, KEY_RIGHT_CONTROL);
+        const float scroll = input.wheel;
+        if (scroll != 0.0f && ctrl) {
+            // Zoom around the canvas point under the cursor
+            const Vector2 cursor = input.mouse;
+            const float new_zoom = CLAMP(1.0f/16.0f, zoom*powf(1.25f, scroll), 16.0f);
+            target_x += (cursor.x - w/2.0f)*(1.0f/zoom - 1.0f/new_zoom);
+            target_y += (cursor.y - h/2.0f)*(1.0f/zoom - 1.0f/new_zoom);
+            zoom = new_zoom;
+        } else if (scroll != 0.0f) {
             brush_radius += 5.0f*scroll;
             if (brush_radius <= 0.0f)
                 brush_radius = 1.0f;
         }
 
-        if (IsKeyPressed(KEY_C)) {
-            clear_framebuffer(&log, framebuffer, background);
+        // Canvas point under the cursor
+        const Vector2 pointer = {target_x - w/(2.0f*zoom) + input.mouse.x/zoom,
+                                 target_y - h/(2.0f*zoom) + input.mouse.y/zoom};
+
+        // Everything below that touches the whole canvas needs all of it
+        // uploaded first
+        if (input_key_pressed(&input, KEY_C) && !ctrl) {
+            project_stream(&project, log, canvas_bounds(canvas));
+            stats_start(&stats, STATS_UNDO);
+            if (vector_undo > 0)
+                history_clear(&history);
+            else
+                undo_log_clear(layer_log);
+            net_send_clear(&net, layers.active);
+            stats_stop(&stats, STATS_UNDO);
+            journal_mark(&journal, canvas, canvas_bounds(canvas));
+            canvas_changed = canvas_bounds(canvas);
+        }
+
+        if (input_key_pressed(&input, KEY_S)) {
+            project_stream(&project, log, canvas_bounds(canvas));
+            const Canvas *flat = layers_flatten(&layers, canvas_bounds(canvas));
+            exporter_submit(&exporter, export_read(flat, canvas_bounds(flat), save_path, exporter.crop));
+        }
+
+        // Pending tiles are copied from the mapped project as is
+        if (input_key_pressed(&input, KEY_P)) {
+            project_save(project_path, log, &palette, &project);
+        }
+
+        //
+        // Selections. Moving one changes the canvas like a stroke does, the
+        // region it touched is pushed when the mouse is released below.
+        //
+
+        const bool shift = input_key_down(&input, KEY_LEFT_SHIFT) || input_key_down(&input, KEY_RIGHT_SHIFT);
+        if (shift && input_button_pressed(&input, MOUSE_BUTTON_LEFT) && !input_button_down(&input, MOUSE_BUTTON_RIGHT)) {
+            if (vector_undo > 0) {
+                fprintf(stderr, "[warning]: Selections don't work with --vector-undo\n");
+            } else if (selection_contains(&selection, pointer)) {
+                project_stream(&project, log, canvas_bounds(canvas));
+                undo_log_truncate(layer_log);
+                const Bounds lifted = selection_lift(&selection, layer_canvas, pointer, ctrl);
+                stroke_bounds = bounds_union(stroke_bounds, lifted);
+                canvas_changed = bounds_union(canvas_changed, lifted);
+            } else {
+                selection_begin(&selection, pointer);
+            }
+        }
+        selection_update(&selection, layer_canvas, pointer);
+        if (input_button_released(&input, MOUSE_BUTTON_LEFT) && selection.drag != SELECTION_NONE) {
+            const Bounds moved = selection_end(&selection, layer_canvas);
+            if (!bounds_is_empty(moved)) {
+                stroke_bounds = bounds_union(stroke_bounds, moved);
+                journal_mark(&journal, canvas, stroke_bounds);
+                net_send_region(&net, &layers, layers.active, stroke_bounds);
+                canvas_changed = bounds_union(canvas_changed, moved);
+            }
+        }
+
+        // The clipboard holds pixels of the active layer. Pasting selects
+        // them, so they can be moved into place.
+        if (ctrl && bounds_is_empty(stroke_bounds) && selection.drag == SELECTION_NONE && vector_undo == 0 &&
+            !input_button_down(&input, MOUSE_BUTTON_LEFT) && !input_button_down(&input, MOUSE_BUTTON_RIGHT)) {
+            const bool cut = input_key_pressed(&input, KEY_X);
+            Bounds changed = BOUNDS_EMPTY;
+            if ((input_key_pressed(&input, KEY_C) || cut) && !bounds_is_empty(selection.bounds)) {
+                project_stream(&project, log, selection.bounds);
+                selection_copy(&selection, layer_canvas);
+                if (cut) {
+                    canvas_clear_bounds(layer_canvas, selection.bounds);
+                    changed = selection.bounds;
+                }
+            }
+            if (input_key_pressed(&input, KEY_V) && selection.clipboard.id != 0) {
+                project_stream(&project, log, canvas_bounds(canvas));
+                changed = selection_paste(&selection, layer_canvas, pointer);
+            }
+            if (!bounds_is_empty(changed)) {
+                undo_log_truncate(layer_log);
+                undo_log_push(layer_log, changed);
+                journal_mark(&journal, canvas, changed);
+                net_send_region(&net, &layers, layers.active, changed);
+                canvas_changed = bounds_union(canvas_changed, changed);
+            }
         }
 
-        if (IsKeyPressed(KEY_S)) {
-            Image image = LoadImageFromTexture(framebuffer.texture);
-            ExportImage(image, save_path);
-            UnloadImage(image);
+        // Mouse 1 drags the selection instead while shift+mouse 1 is held
+        const bool paint = input_button_down(&input, MOUSE_BUTTON_LEFT) && selection.drag == SELECTION_NONE;
+        const bool drawing = paint || input_button_down(&input, MOUSE_BUTTON_RIGHT);
+
+        // A smoothed stroke trails the last sample, so its end is drawn
+        // before the stroke is pushed
+        if (!drawing && stroke_buffer_finish(&stroke)) {
+            stats_start(&stats, STATS_STROKE);
+            const Bounds drawn = stroke_buffer_draw(&stroke, &layers, layers.active, &brush,
+                                                    (vector_undo > 0) ? &history : NULL, &net, stroke_color);
+            stroke_bounds = bounds_union(stroke_bounds, drawn);
+            stats_stop(&stats, STATS_STROKE);
+            journal_mark(&journal, canvas, drawn);
+            canvas_changed = bounds_union(canvas_changed, drawn);
         }
 
         //
@@ -248,42 +6036,90 @@ int main(int argc, char **argv) {
         // the undo log.
         //
 
-        // Compute distance between the `top` of the undo log, and the `selected` entry.
-        const size_t log_top_dist = (log.top + log.size - log.selected) % log.size;
-
-        // If the distance to the top of the log is > 1 then it means
-        // we have selected a previous entry, if so we need to handle
-        // going forwards in the log, but also clearing the log from
-        // the selected entry to the top if the user starts drawing
-        // again.
-        if (log_top_dist > 1) {
-            // Clear the log from selected -> top
-            if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT) || IsMouseButtonPressed(MOUSE_BUTTON_RIGHT)) {
-                for (size_t i = (log.selected + 1) % log.size; i != log.top; i = (i + 1) % log.size) {
-                    UnloadImage(log.images[i]);
+        stats_start(&stats, STATS_UNDO);
+        if (vector_undo > 0) {
+            const bool undo = input_key_pressed(&input, KEY_Q) || input_button_pressed(&input, MOUSE_BUTTON_SIDE);
+            const bool redo = input_key_pressed(&input, KEY_W) || input_button_pressed(&input, MOUSE_BUTTON_EXTRA);
+            if (redo && history_can_redo(&history)) {
+                const Bounds changed = history_redo(&history);
+                journal_mark(&journal, canvas, changed);
+                canvas_changed = bounds_union(canvas_changed, changed);
+            }
+            if (undo && history_can_undo(&history)) {
+                const Bounds changed = history_undo(&history);
+                journal_mark(&journal, canvas, changed);
+                canvas_changed = bounds_union(canvas_changed, changed);
+            }
+            if (input_button_released(&input, MOUSE_BUTTON_LEFT) || input_button_released(&input, MOUSE_BUTTON_RIGHT)) {
+                history_end_stroke(&history);
+                stroke_bounds = BOUNDS_EMPTY;
+            }
+        } else {
+            // Compute distance between the `top` of the undo log, and the `selected` entry.
+            const size_t log_top_dist = (layer_log->top + layer_log->size - layer_log->selected) % layer_log->size;
+
+            // If the distance to the top of the log is > 1 then it means
+            // we have selected a previous entry, if so we need to handle
+            // going forwards in the log, but also clearing the log from
+            // the selected entry to the top if the user starts drawing
+            // again.
+            if (log_top_dist > 1) {
+                // Clear the log from selected -> top, which keeps the log
+                // entry for the selected one
+                if ((input_button_pressed(&input, MOUSE_BUTTON_LEFT) && !shift) ||
+                    input_button_pressed(&input, MOUSE_BUTTON_RIGHT)) {
+                    undo_log_truncate(layer_log);
+                }
+
+                // Handle going forwards in the log
+                if (input_key_pressed(&input, KEY_W) || input_button_pressed(&input, MOUSE_BUTTON_EXTRA)) {
+                    project_stream(&project, log, canvas_bounds(canvas));
+                    const Bounds changed = undo_log_copy(layer_log, 1);
+                    journal_mark(&journal, canvas, changed);
+                    net_send_region(&net, &layers, layers.active, changed);
+                    canvas_changed = bounds_union(canvas_changed, changed);
                 }
-                // Set the new top to be one past the selected entry;
-                log.top = (log.selected + 1) % log.size;
-                // We remove log_top_dist-1 entries since we want to keep the log entry
-                // for undo_log_selected.
-                log.used_size -= log_top_dist - 1;
             }
 
-            // Handle going forwards in the log
-            if (IsKeyPressed(KEY_W) || IsMouseButtonPressed(MOUSE_BUTTON_EXTRA)) {
-                undo_log_copy(&log, framebuffer, 1);
+            // Handle going backwards in the log
+            if (log_top_dist < layer_log->used_size && (input_key_pressed(&input, KEY_Q) || input_button_pressed(&input, MOUSE_BUTTON_SIDE))) {
+                project_stream(&project, log, canvas_bounds(canvas));
+                const Bounds changed = undo_log_copy(layer_log, -1);
+                journal_mark(&journal, canvas, changed);
+                net_send_region(&net, &layers, layers.active, changed);
+                canvas_changed = bounds_union(canvas_changed, changed);
             }
-        }
 
-        // Handle going backwards in the log
-        if (log_top_dist < log.used_size && (IsKeyPressed(KEY_Q) || IsMouseButtonPressed(MOUSE_BUTTON_SIDE))) {
-            undo_log_copy(&log, framebuffer, -1);
+            // When the user releases the mouse we want to push a new entry
+            // into the undo log.
+            if (input_button_released(&input, MOUSE_BUTTON_LEFT) || input_button_released(&input, MOUSE_BUTTON_RIGHT)) {
+                undo_log_push(layer_log, stroke_bounds);
+                net_send_commit(&net, layers.active);
+                stroke_bounds = BOUNDS_EMPTY;
+            }
         }
+        stats_stop(&stats, STATS_UNDO);
 
-        // When the user releases the mouse we want to push a new entry
-        // into the undo log.
-        if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT) || IsMouseButtonReleased(MOUSE_BUTTON_RIGHT)) {
-            undo_log_push(&log, framebuffer);
+        // Fills read the undo log's copy of the canvas, so not mid-stroke
+        // when it's behind, and not with stroke history which can't replay
+        // them
+        if (input_key_pressed(&input, KEY_F) && bounds_is_empty(stroke_bounds) &&
+            !input_button_down(&input, MOUSE_BUTTON_LEFT) && !input_button_down(&input, MOUSE_BUTTON_RIGHT)) {
+            if (vector_undo > 0) {
+                fprintf(stderr, "[warning]: Fill doesn't work with --vector-undo\n");
+            } else {
+                project_stream(&project, log, canvas_bounds(canvas));
+                stats_start(&stats, STATS_STROKE);
+                const Bounds filled = canvas_fill(layer_log, floorf(pointer.x), floorf(pointer.y), brush_color,
+                                                  MIN(fill_tolerance, 255), layers.active > 0);
+                stats_stop(&stats, STATS_STROKE);
+                if (!bounds_is_empty(filled)) {
+                    undo_log_push(layer_log, filled);
+                    journal_mark(&journal, canvas, filled);
+                    net_send_region(&net, &layers, layers.active, filled);
+                    canvas_changed = bounds_union(canvas_changed, filled);
+                }
+            }
         }
 
         //
@@ -291,63 +6127,216 @@ int main(int argc, char **argv) {
         //
 
         prev_mouse_pos = mouse_pos;
-        mouse_pos = GetMousePosition();
+        mouse_pos = input.mouse;
 
-        if (IsMouseButtonDown(MOUSE_BUTTON_MIDDLE)) {
-            target_x -= mouse_pos.x - prev_mouse_pos.x;
-            target_y -= mouse_pos.y - prev_mouse_pos.y;
+        // Size of the window in canvas pixels
+        const float view_w = w/zoom;
+        const float view_h = h/zoom;
 
-            // Don't allow the camera target to stray outside the canvas
-            target_x = CLAMP(w/2, target_x, MAX(0, (int)canvas_width  - w/2));
-            target_y = CLAMP(h/2, target_y, MAX(0, (int)canvas_height - h/2));
+        if (input_button_down(&input, MOUSE_BUTTON_MIDDLE)) {
+            target_x -= (mouse_pos.x - prev_mouse_pos.x)/zoom;
+            target_y -= (mouse_pos.y - prev_mouse_pos.y)/zoom;
         }
 
-        if (IsWindowResized()) {
-            // Don't allow the camera target to stray outside the canvas
-            target_x = CLAMP(w/2, target_x, MAX(0, (int)canvas_width  - w/2));
-            target_y = CLAMP(h/2, target_y, MAX(0, (int)canvas_height - h/2));
-        }
+        // Don't allow the camera target to stray outside the canvas
+        target_x = CLAMP(view_w/2, target_x, MAX(0.0f, canvas_width  - view_w/2));
+        target_y = CLAMP(view_h/2, target_y, MAX(0.0f, canvas_height - view_h/2));
+
+        // Canvas point in the top left corner of the window
+        const Vector2 origin = {target_x - view_w/2, target_y - view_h/2};
+
+        // Upload the project tiles scrolling into view, padded by the brush
+        // radius since strokes reach that far past the window
+        const int pad = ceilf(brush_radius) + 1;
+        project_stream(&project, log, (Bounds){floorf(origin.x) - pad, floorf(origin.y) - pad,
+                                                ceilf(origin.x + view_w) + pad, ceilf(origin.y + view_h) + pad});
+        stats_stop(&stats, STATS_INPUT);
 
         //
         // Drawing
         //
 
-        BeginTextureMode(framebuffer);
-        if (IsMouseButtonDown(MOUSE_BUTTON_LEFT) || IsMouseButtonDown(MOUSE_BUTTON_RIGHT)) {
+        if (drawing) {
             // On left-click draw with selected color, otherwise draw with the background color
-            // to "erase."
-            Color color = (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) ? brush_color : background;
-            // Since the framebuffer we're drawing to is much larger than the size of the
+            // to "erase." Layers above the bottom one erase to transparency.
+            stroke_color = paint ? brush_color :
+                           (layers.active == 0) ? background : BLANK;
+            // Since the canvas we're drawing to is much larger than the size of the
             // window (probably), we need to calculate some new coordinates.
-            Vector2 offset = {target_x - w/2, target_y - h/2};
-            Vector2 start = Vector2Add(offset, prev_mouse_pos);
-            Vector2 end = Vector2Add(offset, mouse_pos);
-            // Invert y-coord as texture/raylib y-coords are inverted.
-            start.y = canvas_height - start.y;
-            end.y = canvas_height - end.y;
-            // Draw a capsule from the previous mouse position to the current
-            // one.
-            DrawCircleV(start, brush_radius, color);
-            DrawLineEx(start, end, 2.0f*brush_radius, color);
-            DrawCircleV(end, brush_radius, color);
-        }
-        EndTextureMode();
+            // A tablet delivers every sample since last frame, the mouse only
+            // where it is now. New mouse strokes start from the previous
+            // mouse position.
+            if (input.sample_count > 0) {
+                for (int i = 0; i < input.sample_count; ++i) {
+                    const TabletSample *sample = &input.samples[i];
+                    pressure = sample->pressure;
+                    stroke_buffer_push(&stroke, Vector2Add(origin, Vector2Scale((Vector2){sample->x, sample->y}, 1.0f/zoom)),
+                                       brush_radius*pressure);
+                }
+            } else {
+                if (stroke.count == 0)
+                    stroke_buffer_push(&stroke, Vector2Add(origin, Vector2Scale(prev_mouse_pos, 1.0f/zoom)),
+                                       brush_radius*pressure);
+                stroke_buffer_push(&stroke, Vector2Add(origin, Vector2Scale(mouse_pos, 1.0f/zoom)),
+                                   brush_radius*pressure);
+            }
+            // Draw capsules through all samples since last frame, and grow
+            // the region touched by this stroke
+            stats_start(&stats, STATS_STROKE);
+            Bounds drawn = stroke_buffer_draw(&stroke, &layers, layers.active, &brush,
+                                              (vector_undo > 0) ? &history : NULL, &net, stroke_color);
+            stroke_bounds = bounds_union(stroke_bounds, drawn);
+            stats_stop(&stats, STATS_STROKE);
+            stroke_buffer_advance(&stroke);
+            journal_mark(&journal, canvas, drawn);
+            canvas_changed = bounds_union(canvas_changed, drawn);
+        } else {
+            stroke_buffer_reset(&stroke);
+            // The next stroke may well be the mouse's
+            if (input.sample_count == 0)
+                pressure = 1.0f;
+        }
+
+        // Send this frame's strokes and apply everyone else's
+        const Bounds remote = net_poll(&net, &layers, logs, &brush);
+        journal_mark(&journal, canvas, remote);
+        canvas_changed = bounds_union(canvas_changed, remote);
+
+        //
+        // Present, unless we're waiting for events and the frame would look
+        // the same as the last one. Input still has to be polled then.
+        //
+
+        const View view = {
+            .x = origin.x,
+            .y = origin.y,
+            .zoom = zoom,
+            .width = w,
+            .height = h,
+            .cursor = mouse_pos,
+            .brush_radius = brush_radius,
+            .brush_color = brush_color,
+            .focused = input.focused,
+            .overlay = stats.overlay,
+            .layer = layers.active,
+            .hidden = layers.hidden,
+            .selection = selection_target(&selection),
+        };
+        if (autosave_interval > 0 && GetTime() - journal.last_save >= autosave_interval)
+            journal_save(&journal, canvas);
+
+        if (wait_events && bounds_is_empty(canvas_changed) && view_equal(view, presented)) {
+            // We might block for a long time, so don't leave changes
+            // unsaved until then
+            journal_save(&journal, canvas);
+            PollInputEvents();
+            continue;
+        }
+        Bounds damage = view_damage(view, presented, canvas_changed);
+        // The overlay's numbers change every frame
+        if (view.overlay || presented.overlay)
+            damage = bounds_union(damage, stats_bounds());
+        if (frame.texture.width != w || frame.texture.height != h) {
+            if (frame.id != 0)
+                UnloadRenderTexture(frame);
+            frame = LoadRenderTexture(w, h);
+            damage = (Bounds){0, 0, w, h};
+            recent_count = 0;
+        }
+        if (!partial_redraw)
+            damage = (Bounds){0, 0, w, h};
+        presented = view;
 
         BeginDrawing();
-        ClearBackground(background);
-        // Draw what the use has painted
-        DrawTextureRec(framebuffer.texture, (Rectangle){target_x-w/2,target_y-h/2,w,h}, (Vector2){0,0}, WHITE);
-        // Draw cursor
-        DrawCircleLines(mouse_pos.x, mouse_pos.y, brush_radius, WHITE);
-        DrawCircleLines(mouse_pos.x, mouse_pos.y, 1.2f*brush_radius, brush_color);
+        stats_start(&stats, STATS_DRAW);
+        // Composite everything visible, so tiles don't go stale on screen
+        const Bounds visible = {floorf(view.x), floorf(view.y), ceilf(view.x + w/zoom), ceilf(view.y + h/zoom)};
+        Canvas *flat = layers_flatten(&layers, visible);
+        if (!bounds_is_empty(damage)) {
+            BeginTextureMode(frame);
+            BeginScissorMode(damage.x0, damage.y0, damage.x1 - damage.x0, damage.y1 - damage.y0);
+            ClearBackground(background);
+            // Draw what the use has painted
+            canvas_draw(flat, view.x, view.y, zoom, damage);
+            selection_draw(&selection, view.x, view.y, zoom);
+            // Draw cursor, the brush radius is in canvas pixels
+            DrawCircleLines(mouse_pos.x, mouse_pos.y, zoom*brush_radius, WHITE);
+            DrawCircleLines(mouse_pos.x, mouse_pos.y, 1.2f*zoom*brush_radius, brush_color);
+            if (layers.count > 1)
+                DrawText(TextFormat("layer %d/%d%s", layers.active + 1, layers.count,
+                                    layers_visible(&layers, layers.active) ? "" : " (hidden)"),
+                         10, h - 30, 20, WHITE);
+            stats_draw(&stats);
+            EndScissorMode();
+            EndTextureMode();
+        }
+
+        // A back buffer presented `age` frames ago misses the damage of the
+        // frames since then
+        Bounds copied = {0, 0, w, h};
+        const unsigned age = use_buffer_age ? buffer_age() : 0;
+        if (age > 0 && (int)age <= recent_count + 1) {
+            copied = damage;
+            for (unsigned i = 0; i + 1 < age; ++i)
+                copied = bounds_union(copied, recent[i]);
+        }
+        memmove(&recent[1], &recent[0], (MAX_BUFFER_AGE - 2)*sizeof(Bounds));
+        recent[0] = damage;
+        recent_count = MIN(recent_count + 1, MAX_BUFFER_AGE - 1);
+        // Render textures and the window are both bottom up, so this needs
+        // no flip
+        if (!bounds_is_empty(copied))
+            blit_framebuffer(frame, copied.x0, h - copied.y1, (RenderTexture2D){0}, copied.x0, h - copied.y1,
+                             copied.x1 - copied.x0, copied.y1 - copied.y0);
+        stats_stop(&stats, STATS_DRAW);
+        stats_start(&stats, STATS_PRESENT);
         EndDrawing();
+        stats_stop(&stats, STATS_PRESENT);
+
+        size_t cpu_memory = 0, gpu_memory = 0, undo_entries = 0;
+        if (vector_undo > 0) {
+            cpu_memory = history_memory(&history);
+            undo_entries = history.stroke_count;
+        } else {
+            for (int i = 0; i < layers.count; ++i) {
+                size_t cpu, gpu;
+                undo_log_memory(&logs[i], &cpu, &gpu);
+                cpu_memory += cpu;
+                gpu_memory += gpu;
+                // The oldest entry is the state the log started from
+                undo_entries += logs[i].used_size - 1;
+            }
+        }
+        stats_end_frame(&stats, cpu_memory, gpu_memory, undo_entries);
     }
 
-    free(log.images);
+    for (int i = 0; i < layers.count; ++i)
+        undo_log_free(&logs[i]);
+    exporter_stop(&exporter);
+    if (journal.file != NULL) {
+        journal_close(&journal);
+        remove(autosave_path);
+    }
 
-    UnloadRenderTexture(framebuffer);
+    project_unmap(&project);
+    stats_close(&stats);
+    if (record != NULL)
+        fclose(record);
+    if (replay != NULL)
+        fclose(replay);
+    tablet_close(&tablet);
+    net_close(&net);
+    if (vector_undo > 0)
+        history_unload(&history);
+    selection_unload(&selection);
+    if (frame.id != 0)
+        UnloadRenderTexture(frame);
+    layers_unload(&layers);
+    brush_unload(&brush);
+    stroke_buffer_free(&stroke);
     ShowCursor();
     CloseWindow();
 
     return 0;
 }
+#endif // BEAK_NO_MAIN
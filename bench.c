@@ -0,0 +1,337 @@
+//
+// Benchmark harness for beak. Builds beak.c without its main and drives the
+// same drawing, undo and export code with a hidden window, replaying a
+// stroke script at several canvas and undo log sizes.
+//
+// usage: beak-bench [script]
+//        beak-bench --render <width>x<height> <image> <thumbnail> [script]
+//
+// --render draws the script with the CPU rasterizer alone, without opening a
+// window, and writes the canvas and a thumbnail of it.
+//
+// Scripts are text files with one stroke per `stroke` line followed by its
+// samples, coordinates are fractions of the canvas size so the same script
+// works at every size:
+//
+//     stroke <radius> <0xRRGGBBAA>
+//     <x> <y>
+//     ...
+//
+// Without a script a fixed pseudo-random one is generated.
+//
+#define BEAK_NO_MAIN
+#include "beak.c"
+
+#include <sys/resource.h>
+
+// Samples drawn per frame, about what a mouse delivers at 60 Hz
+#define BENCH_SAMPLES_PER_FRAME 4
+#define BENCH_EXPORTS 3
+#define BENCH_EXPORT_PATH "/tmp/beak-bench.png"
+#define BENCH_THUMBNAIL_SIZE 256
+
+typedef struct BenchStroke {
+    size_t first;
+    size_t count;
+    float radius;
+    Color color;
+} BenchStroke;
+
+typedef struct BenchScript {
+    Vector2 *points;
+    size_t point_count, point_capacity;
+    BenchStroke *strokes;
+    size_t stroke_count, stroke_capacity;
+} BenchScript;
+
+static void bench_add_stroke(BenchScript *script, float radius, Color color) {
+    script->strokes = grow_array(script->strokes, &script->stroke_capacity,
+                                 script->stroke_count + 1, sizeof(BenchStroke));
+    script->strokes[script->stroke_count++] = (BenchStroke){script->point_count, 0, radius, color};
+}
+
+static void bench_add_point(BenchScript *script, Vector2 point) {
+    script->points = grow_array(script->points, &script->point_capacity,
+                                script->point_count + 1, sizeof(Vector2));
+    script->points[script->point_count++] = point;
+    ++script->strokes[script->stroke_count - 1].count;
+}
+
+static bool bench_load_script(BenchScript *script, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "[error]: Failed to open script '%s'\n", path);
+        return false;
+    }
+
+    char line[256];
+    size_t line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        ++line_number;
+        float radius, x, y;
+        unsigned long color;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        } else if (sscanf(line, "stroke %f %lx", &radius, &color) == 2) {
+            bench_add_stroke(script, radius, GetColor(color));
+        } else if (script->stroke_count > 0 && sscanf(line, "%f %f", &x, &y) == 2) {
+            bench_add_point(script, (Vector2){x, y});
+        } else {
+            fprintf(stderr, "[error]: %s:%zu: Invalid script line\n", path, line_number);
+            fclose(file);
+            return false;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+// Deterministic random walks of varying radius and color
+static void bench_generate_script(BenchScript *script) {
+    Palette palette;
+    palette_generate(&palette, 5);
+    uint32_t state = 0x2545f491;
+    #define BENCH_RANDOM() ((state = state*1664525u + 1013904223u) >> 8)/(float)(1 << 24)
+    for (int i = 0; i < 200; ++i) {
+        bench_add_stroke(script, 2.0f + 38.0f*BENCH_RANDOM(), palette.colors[i % palette.count]);
+        Vector2 point = {BENCH_RANDOM(), BENCH_RANDOM()};
+        for (int j = 0; j < 64; ++j) {
+            bench_add_point(script, point);
+            point.x = CLAMP(0.0f, point.x + 0.02f*(BENCH_RANDOM() - 0.5f), 1.0f);
+            point.y = CLAMP(0.0f, point.y + 0.02f*(BENCH_RANDOM() - 0.5f), 1.0f);
+        }
+    }
+    #undef BENCH_RANDOM
+}
+
+static const Color bench_background = {0x11, 0x16, 0x00, 0xFF};
+
+static Vector2 *bench_scale_points(const BenchScript *script, int width, int height) {
+    Vector2 *points = malloc(script->point_count*sizeof(Vector2));
+    for (size_t i = 0; i < script->point_count; ++i)
+        points[i] = (Vector2){script->points[i].x*width, script->points[i].y*height};
+    return points;
+}
+
+// Draws the script with the CPU rasterizer in the same frame sized pieces as
+// the GPU, which overlap by a sample, so both produce the same pixels
+static void bench_raster(const BenchScript *script, const Vector2 *points,
+                         Rasterizer *rasterizer, RasterCanvas *canvas) {
+    for (size_t i = 0; i < script->stroke_count; ++i) {
+        const BenchStroke *stroke = &script->strokes[i];
+        for (size_t j = 0; j < stroke->count; j += BENCH_SAMPLES_PER_FRAME) {
+            const size_t first = (j == 0) ? 0 : j - 1;
+            const size_t last = MIN(j + BENCH_SAMPLES_PER_FRAME, stroke->count);
+            raster_draw_stroke(rasterizer, canvas, &points[stroke->first + first],
+                               last - first, stroke->radius, stroke->color);
+        }
+    }
+}
+
+// Largest difference of any channel between two images of the same size
+static int bench_max_difference(Image a, Image b) {
+    const Color *pa = a.data, *pb = b.data;
+    int difference = 0;
+    for (size_t i = 0; i < (size_t)a.width*a.height; ++i) {
+        difference = MAX(difference, abs(pa[i].r - pb[i].r));
+        difference = MAX(difference, abs(pa[i].g - pb[i].g));
+        difference = MAX(difference, abs(pa[i].b - pb[i].b));
+        difference = MAX(difference, abs(pa[i].a - pb[i].a));
+    }
+    return difference;
+}
+
+static void bench_run(const BenchScript *script, int width, int height, size_t undo_log_size,
+                      Brush *brush, Rasterizer *rasterizer) {
+    const Color background = bench_background;
+    Canvas canvas;
+    canvas_init(&canvas, width, height, background);
+    UndoLog log;
+    undo_log_init(&log, &canvas, undo_log_size, 0, 64 << 20);
+    undo_log_clear(&log);
+
+    //
+    // Strokes, drawn a frame's worth of samples at a time and pushed to the
+    // undo log on release like the interactive loop does
+    //
+
+    Vector2 *points = bench_scale_points(script, width, height);
+
+    double start = GetTime();
+    for (size_t i = 0; i < script->stroke_count; ++i) {
+        const BenchStroke *stroke = &script->strokes[i];
+        Bounds bounds = BOUNDS_EMPTY;
+        for (size_t j = 0; j < stroke->count; j += BENCH_SAMPLES_PER_FRAME) {
+            // Each frame continues from the last sample of the previous one
+            const size_t first = (j == 0) ? 0 : j - 1;
+            const size_t last = MIN(j + BENCH_SAMPLES_PER_FRAME, stroke->count);
+            const Bounds drawn = canvas_draw_stroke(&canvas, brush, &points[stroke->first + first],
+                                                    last - first, stroke->radius, stroke->color);
+            bounds = bounds_union(bounds, drawn);
+            undo_log_poll(&log);
+        }
+        undo_log_push(&log, bounds);
+    }
+    undo_log_finish(&log);
+    glFinish();
+    const double stroke_time = GetTime() - start;
+
+    size_t cpu_memory, gpu_memory;
+    undo_log_memory(&log, &cpu_memory, &gpu_memory);
+
+    //
+    // The same strokes on the CPU, compared against the GPU canvas
+    //
+
+    RasterCanvas raster;
+    raster_canvas_init(&raster, width, height, background);
+    start = GetTime();
+    bench_raster(script, points, rasterizer, &raster);
+    const double raster_time = GetTime() - start;
+
+    Image gpu_image = canvas_load_image(&canvas);
+    Image cpu_image = raster_load_image(&raster);
+    const int difference = bench_max_difference(gpu_image, cpu_image);
+    UnloadImage(cpu_image);
+    UnloadImage(gpu_image);
+    raster_canvas_unload(&raster);
+
+    //
+    // Undo everything the log holds, then redo it
+    //
+
+    const size_t depth = MIN(log.used_size - 1, script->stroke_count);
+    start = GetTime();
+    for (size_t i = 0; i < depth; ++i)
+        undo_log_copy(&log, -1);
+    for (size_t i = 0; i < depth; ++i)
+        undo_log_copy(&log, 1);
+    glFinish();
+    const double undo_time = GetTime() - start;
+
+    //
+    // Exports, the readback and band encoding happen on the main thread and
+    // the PNG encode on the exporter thread, so they're timed separately
+    //
+
+    double readback_time = 0.0, encode_time = 0.0;
+    for (int i = 0; i < BENCH_EXPORTS; ++i) {
+        start = GetTime();
+        ExportJob job = export_read(&canvas, canvas_bounds(&canvas), BENCH_EXPORT_PATH, false);
+        readback_time += GetTime() - start;
+        start = GetTime();
+        export_write(&job, 6, false);
+        export_free(&job);
+        encode_time += GetTime() - start;
+    }
+    remove(BENCH_EXPORT_PATH);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("%5dx%-6d %6zu %11.1f %11.1f %9d %11.1f %12.2f %10.2f %10.1f %10.1f %10.1f\n",
+           width, height, undo_log_size,
+           script->stroke_count/stroke_time,
+           script->stroke_count/raster_time, difference,
+           (depth > 0) ? 2*depth/undo_time : 0.0,
+           1000.0*readback_time/BENCH_EXPORTS,
+           1000.0*encode_time/BENCH_EXPORTS,
+           cpu_memory/(1024.0*1024.0), gpu_memory/(1024.0*1024.0),
+           usage.ru_maxrss/1024.0);
+    fflush(stdout);
+
+    free(points);
+    undo_log_free(&log);
+    canvas_unload(&canvas);
+}
+
+// Headless rendering of a script, needs no window or GL context
+static int bench_render(const BenchScript *script, int width, int height,
+                        const char *image_path, const char *thumbnail_path) {
+    Rasterizer rasterizer;
+    rasterizer_start(&rasterizer, 0);
+    RasterCanvas canvas;
+    raster_canvas_init(&canvas, width, height, bench_background);
+    Vector2 *points = bench_scale_points(script, width, height);
+
+    const double start = GetTime();
+    bench_raster(script, points, &rasterizer, &canvas);
+    printf("%zu strokes in %.1f ms on %d threads\n", script->stroke_count,
+           1000.0*(GetTime() - start), rasterizer.thread_count + 1);
+
+    Image image = raster_load_image(&canvas);
+    Image thumbnail = raster_thumbnail(&canvas, BENCH_THUMBNAIL_SIZE);
+    const bool ok = ExportImage(image, image_path) && ExportImage(thumbnail, thumbnail_path);
+    if (!ok)
+        fprintf(stderr, "[error]: Failed to write '%s' or '%s'\n", image_path, thumbnail_path);
+    UnloadImage(thumbnail);
+    UnloadImage(image);
+
+    free(points);
+    raster_canvas_unload(&canvas);
+    rasterizer_stop(&rasterizer);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int render_width = 0, render_height = 0;
+    const char *image_path = NULL, *thumbnail_path = NULL;
+    if (argc > 1 && strcmp(argv[1], "--render") == 0) {
+        if (argc < 5 || sscanf(argv[2], "%dx%d", &render_width, &render_height) != 2 ||
+            render_width <= 0 || render_height <= 0) {
+            fprintf(stderr, "[error]: usage: %s --render <width>x<height> <image> <thumbnail> [script]\n", argv[0]);
+            return -1;
+        }
+        image_path = argv[3];
+        thumbnail_path = argv[4];
+        argc -= 4;
+        argv += 4;
+    }
+
+    BenchScript script = {0};
+    if (argc > 1) {
+        if (!bench_load_script(&script, argv[1]))
+            return -1;
+    } else {
+        bench_generate_script(&script);
+    }
+
+    if (image_path != NULL) {
+        const int result = bench_render(&script, render_width, render_height, image_path, thumbnail_path);
+        free(script.points);
+        free(script.strokes);
+        return result;
+    }
+
+    SetTraceLogLevel(LOG_ERROR);
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(64, 64, "beak-bench");
+
+    Brush brush;
+    brush_load(&brush);
+    Rasterizer rasterizer;
+    rasterizer_start(&rasterizer, 0);
+
+    static const int sizes[][2] = {
+        {1280, 720},
+        {2560, 1440},
+        {7680, 4320},
+    };
+    static const size_t undo_log_sizes[] = {16, 64};
+
+    printf("%zu strokes, %zu samples, %s brush\n\n", script.stroke_count, script.point_count,
+           (brush.shader.id != 0) ? "shader" : "triangle");
+    printf("%-12s %6s %11s %11s %9s %11s %12s %10s %10s %10s %10s\n",
+           "canvas", "undo", "strokes/s", "cpu str/s", "cpu diff", "undo ops/s", "readback ms",
+           "encode ms", "undo MiB", "undo VRAM", "peak MiB");
+    for (size_t i = 0; i < ARRLEN(sizes); ++i)
+        for (size_t j = 0; j < ARRLEN(undo_log_sizes); ++j)
+            bench_run(&script, sizes[i][0], sizes[i][1], undo_log_sizes[j], &brush, &rasterizer);
+
+    rasterizer_stop(&rasterizer);
+    brush_unload(&brush);
+    CloseWindow();
+    free(script.points);
+    free(script.strokes);
+    return 0;
+}